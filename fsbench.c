@@ -0,0 +1,595 @@
+/*
+
+  fsbench: runs the MyFS operations in process, calling the
+  __myfs_*_implem functions straight on an anonymous mapping, so the filesystem logic can be timed without FUSE and the
+  kernel round-trips in the way.
+
+  gcc -Wall -O2 fsbench.c implementation.c -lpthread -o fsbench
+
+  fsbench [-s MB] [-f backup-file] [-n ops] [-c seq chunk] [-r random chunk]
+          [-z small file size] [-d depth] [-t threads] [-S seed] [workload]...
+
+  Workloads are create (small-file create storm), seq (large sequential
+  I/O), rand (random I/O in one file), pipe (random chunk writes fed
+  through a pipe to write_buf, after checking that one whose pipe
+  cannot be read fails without touching the file), deep (a long chain of directories),
+  bigdir (one huge directory) and stress (threads running a random mix of
+  create, write, truncate, read, readdir and unlink over the same few
+  directories and files); all of them run when none is given. stress
+  fails on any error the races it sets up cannot explain, and on any
+  block or inode missing once it has removed everything and synced; build with
+  -fsanitize=thread to have the locking checked as well.
+  Each runs on a freshly zeroed image and prints one JSON line per
+  phase with its op count, bytes moved, ops/s, bytes/s and latency
+  percentiles in nanoseconds. With a backup-file, the image still lives
+  in its own private memory, as under FUSE, and each workload ends with
+  a timed flush of it to the file through a descriptor of its own.
+
+*/
+
+#define _GNU_SOURCE
+#include <errno.h>
+#include <fcntl.h>
+#include <pthread.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <sys/statvfs.h>
+#include <sys/types.h>
+#include <time.h>
+#include <unistd.h>
+
+int __myfs_getattr_implem(void *fsptr, size_t fssize, int *errnoptr, uid_t uid, gid_t gid, const char *path, struct stat *stbuf);
+int __myfs_readdir_implem(void *fsptr, size_t fssize, int *errnoptr, const char *path, char ***namesptr);
+int __myfs_mknod_implem(void *fsptr, size_t fssize, int *errnoptr, const char *path);
+int __myfs_unlink_implem(void *fsptr, size_t fssize, int *errnoptr, const char *path);
+int __myfs_rmdir_implem(void *fsptr, size_t fssize, int *errnoptr, const char *path);
+int __myfs_mkdir_implem(void *fsptr, size_t fssize, int *errnoptr, const char *path);
+int __myfs_rename_implem(void *fsptr, size_t fssize, int *errnoptr, const char *from, const char *to);
+int __myfs_truncate_implem(void *fsptr, size_t fssize, int *errnoptr, const char *path, off_t offset);
+int __myfs_read_implem(void *fsptr, size_t fssize, int *errnoptr, const char *path, char *buf, size_t size, off_t off);
+int __myfs_write_implem(void *fsptr, size_t fssize, int *errnoptr, const char *path, const char *buf, size_t size, off_t off);
+int __myfs_writebuf_implem(void *fsptr, size_t fssize, int *errnoptr, const char *path, uint64_t fh, int fd, size_t size, off_t off);
+int __myfs_utimens_implem(void *fsptr, size_t fssize, int *errnoptr, const char *path, const struct timespec ts[2]);
+int __myfs_statfs_implem(void *fsptr, size_t fssize, int *errnoptr, struct statvfs *stbuf);
+int __myfs_flush_implem(void *fsptr, size_t fssize, int *errnoptr, int fd);
+
+#define DIRS_CREATE 16
+#define DIRS_STRESS 4
+#define FILES_STRESS 32
+#define READDIRS 16
+#define PATH_LEN 64
+
+typedef struct {
+	void *fsptr;
+	size_t fssize;
+	int fd;
+	int err;
+	const char *work;
+	size_t ops, seqchunk, randchunk, small, depth, threads;
+	uint64_t seed;
+	char *buf;
+	uint64_t *lat;
+	uint64_t t;
+	int ret;
+} bench;
+
+//Times one call into lat[i] and gives back what it returned
+#define TIMED(b,i,call) ((b)->t=now(),(b)->ret=(call),(b)->lat[i]=now()-(b)->t,(b)->ret)
+
+uint64_t now(void)
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC,&ts);
+	return (uint64_t)ts.tv_sec*1000000000+ts.tv_nsec;
+}
+//xorshift, so a seed gives the same offsets on every run
+uint64_t rnd(bench *b)
+{
+	b->seed^=b->seed<<13;
+	b->seed^=b->seed>>7;
+	b->seed^=b->seed<<17;
+	return b->seed;
+}
+
+void fail(bench *b, const char *phase, const char *path)
+{
+	fprintf(stderr,"fsbench: %s %s %s: %s\n",b->work,phase,path,strerror(b->err));
+	exit(1);
+}
+
+int cmplat(const void *a, const void *b)
+{
+	uint64_t x=*(const uint64_t*)a, y=*(const uint64_t*)b;
+	return (x>y)-(x<y);
+}
+uint64_t pct(uint64_t *lat, size_t count, unsigned permille)
+{
+	return lat[(count-1)*permille/1000];
+}
+//Prints one phase: total is the wall time of the whole loop, so ops/s takes in the bookkeeping between calls too
+void report(bench *b, const char *phase, size_t count, size_t bytes, uint64_t total)
+{
+	double secs=total/1e9;
+
+	if(count==0) return;
+	qsort(b->lat,count,sizeof(uint64_t),cmplat);
+	printf("{\"workload\":\"%s\",\"phase\":\"%s\",\"ops\":%zu,\"bytes\":%zu,\"secs\":%.6f,\"ops_s\":%.1f,\"bytes_s\":%.1f,"
+		"\"p50_ns\":%llu,\"p90_ns\":%llu,\"p99_ns\":%llu,\"p999_ns\":%llu,\"max_ns\":%llu}\n",
+		b->work,phase,count,bytes,secs,secs>0?count/secs:0,secs>0?bytes/secs:0,
+		(unsigned long long)pct(b->lat,count,500),(unsigned long long)pct(b->lat,count,900),
+		(unsigned long long)pct(b->lat,count,990),(unsigned long long)pct(b->lat,count,999),
+		(unsigned long long)b->lat[count-1]);
+	fflush(stdout);
+}
+
+//Every workload starts on a zeroed image, formatted by an untimed call so the first op does not pay for it. The
+//backup-file is never mapped: flushing a mapping of the file onto the file would time writes with nothing to do
+int fresh(bench *b)
+{
+	struct statvfs st;
+
+	if(b->fsptr!=NULL) munmap(b->fsptr,b->fssize);
+	if(b->fd>=0 && (ftruncate(b->fd,0)==-1 || ftruncate(b->fd,b->fssize)==-1)) return -1;
+	b->fsptr=mmap(NULL,b->fssize,PROT_READ|PROT_WRITE,MAP_PRIVATE|MAP_ANONYMOUS,-1,0);
+	if(b->fsptr==MAP_FAILED){
+		b->fsptr=NULL;
+		return -1;
+	}if(__myfs_statfs_implem(b->fsptr,b->fssize,&b->err,&st)==-1){
+		errno=b->err;
+		return -1;
+	}return 0;
+}
+void flush(bench *b)
+{
+	uint64_t start=now();
+
+	if(b->fd<0) return;
+	if(TIMED(b,0,__myfs_flush_implem(b->fsptr,b->fssize,&b->err,b->fd))==-1) fail(b,"flush","-");
+	report(b,"flush",1,0,now()-start);
+}
+
+void wcreate(bench *b)
+{
+	struct timespec ts[2]={{1,0},{2,0}};
+	struct stat st;
+	char path[PATH_LEN];
+	size_t i, bytes;
+	uint64_t start;
+
+	for(i=0;i<DIRS_CREATE;i++){
+		snprintf(path,PATH_LEN,"/d%zu",i);
+		if(__myfs_mkdir_implem(b->fsptr,b->fssize,&b->err,path)==-1) fail(b,"mkdir",path);
+	}
+
+	start=now();
+	for(i=0;i<b->ops;i++){
+		snprintf(path,PATH_LEN,"/d%zu/f%zu",i%DIRS_CREATE,i);
+		if(TIMED(b,i,__myfs_mknod_implem(b->fsptr,b->fssize,&b->err,path))==-1) fail(b,"mknod",path);
+	}report(b,"mknod",b->ops,0,now()-start);
+
+	start=now();
+	for(i=0,bytes=0;i<b->ops;i++,bytes+=b->small){
+		snprintf(path,PATH_LEN,"/d%zu/f%zu",i%DIRS_CREATE,i);
+		if(TIMED(b,i,__myfs_write_implem(b->fsptr,b->fssize,&b->err,path,b->buf,b->small,0))!=(int)b->small) fail(b,"write",path);
+	}report(b,"write",b->ops,bytes,now()-start);
+
+	start=now();
+	for(i=0,bytes=0;i<b->ops;i++,bytes+=b->small){
+		snprintf(path,PATH_LEN,"/d%zu/f%zu",i%DIRS_CREATE,i);
+		if(TIMED(b,i,__myfs_read_implem(b->fsptr,b->fssize,&b->err,path,b->buf,b->small,0))!=(int)b->small) fail(b,"read",path);
+	}report(b,"read",b->ops,bytes,now()-start);
+
+	start=now();
+	for(i=0;i<b->ops;i++){
+		snprintf(path,PATH_LEN,"/d%zu/f%zu",i%DIRS_CREATE,i);
+		if(TIMED(b,i,__myfs_getattr_implem(b->fsptr,b->fssize,&b->err,0,0,path,&st))==-1) fail(b,"getattr",path);
+	}report(b,"getattr",b->ops,0,now()-start);
+
+	start=now();
+	for(i=0;i<b->ops;i++){
+		snprintf(path,PATH_LEN,"/d%zu/f%zu",i%DIRS_CREATE,i);
+		if(TIMED(b,i,__myfs_utimens_implem(b->fsptr,b->fssize,&b->err,path,ts))==-1) fail(b,"utimens",path);
+	}report(b,"utimens",b->ops,0,now()-start);
+	flush(b);
+
+	start=now();
+	for(i=0;i<b->ops;i++){
+		snprintf(path,PATH_LEN,"/d%zu/f%zu",i%DIRS_CREATE,i);
+		if(TIMED(b,i,__myfs_unlink_implem(b->fsptr,b->fssize,&b->err,path))==-1) fail(b,"unlink",path);
+	}report(b,"unlink",b->ops,0,now()-start);
+}
+
+//Half the image at most, so the run stays clear of ENOSPC
+void wseq(bench *b)
+{
+	size_t i, count=b->ops, bytes;
+	uint64_t start;
+
+	if(count*b->seqchunk>b->fssize/2) count=b->fssize/2/b->seqchunk;
+	if(__myfs_mknod_implem(b->fsptr,b->fssize,&b->err,"/seq")==-1) fail(b,"mknod","/seq");
+
+	start=now();
+	for(i=0,bytes=0;i<count;i++,bytes+=b->seqchunk){
+		if(TIMED(b,i,__myfs_write_implem(b->fsptr,b->fssize,&b->err,"/seq",b->buf,b->seqchunk,bytes))!=(int)b->seqchunk) fail(b,"write","/seq");
+	}report(b,"write",count,bytes,now()-start);
+	flush(b);
+
+	start=now();
+	for(i=0,bytes=0;i<count;i++,bytes+=b->seqchunk){
+		if(TIMED(b,i,__myfs_read_implem(b->fsptr,b->fssize,&b->err,"/seq",b->buf,b->seqchunk,bytes))!=(int)b->seqchunk) fail(b,"read","/seq");
+	}report(b,"read",count,bytes,now()-start);
+
+	start=now();
+	if(TIMED(b,0,__myfs_truncate_implem(b->fsptr,b->fssize,&b->err,"/seq",0))==-1) fail(b,"truncate","/seq");
+	report(b,"truncate",1,0,now()-start);
+}
+
+//The file is laid down first, untimed, so random writes overwrite blocks in place rather than fill holes
+void wrand(bench *b)
+{
+	size_t i, len=b->ops*b->randchunk, chunks, ct, bytes;
+	uint64_t start;
+
+	if(len>b->fssize/4) len=b->fssize/4;
+	if((chunks=len/b->randchunk)==0) return;
+	len=chunks*b->randchunk;
+	if(__myfs_mknod_implem(b->fsptr,b->fssize,&b->err,"/rand")==-1) fail(b,"mknod","/rand");
+	for(bytes=0;bytes<len;bytes+=ct){
+		ct=(len-bytes<b->seqchunk)?len-bytes:b->seqchunk;
+		if(__myfs_write_implem(b->fsptr,b->fssize,&b->err,"/rand",b->buf,ct,bytes)!=(int)ct) fail(b,"fill","/rand");
+	}flush(b);
+
+	start=now();
+	for(i=0,bytes=0;i<b->ops;i++,bytes+=b->randchunk){
+		if(TIMED(b,i,__myfs_write_implem(b->fsptr,b->fssize,&b->err,"/rand",b->buf,b->randchunk,rnd(b)%chunks*b->randchunk))!=(int)b->randchunk) fail(b,"randwrite","/rand");
+	}report(b,"randwrite",b->ops,bytes,now()-start);
+	flush(b);
+
+	start=now();
+	for(i=0,bytes=0;i<b->ops;i++,bytes+=b->randchunk){
+		if(TIMED(b,i,__myfs_read_implem(b->fsptr,b->fssize,&b->err,"/rand",b->buf,b->randchunk,rnd(b)%chunks*b->randchunk))!=(int)b->randchunk) fail(b,"randread","/rand");
+	}report(b,"randread",b->ops,bytes,now()-start);
+}
+
+//Puts one chunk in the pipe, untimed, for the next write_buf
+void pipefill(bench *b, int fd, size_t len)
+{
+	if(write(fd,b->buf,len)!=(ssize_t)len){
+		b->err=errno;
+		fail(b,"pipe","-");
+	}
+}
+//The check runs over data, a hole and data again, and past the end: all of it has to read as before once the
+//write_buf fails, the hole as zeros, with the size unchanged
+void wpipe(bench *b)
+{
+	size_t i, rc=b->randchunk, chunks, bytes;
+	char *back=malloc(4*rc);
+	uint64_t start;
+	int fds[2];
+	
+	if(back==NULL){
+		b->err=ENOMEM;
+		fail(b,"setup","-");
+	}if(pipe2(fds,O_NONBLOCK)==-1 || fcntl(fds[1],F_SETPIPE_SZ,rc)==-1 || fcntl(fds[1],F_GETPIPE_SZ)<(int)rc){
+		b->err=errno;
+		fail(b,"pipe","-");
+	}if(__myfs_mknod_implem(b->fsptr,b->fssize,&b->err,"/pipe")==-1) fail(b,"mknod","/pipe");
+	if(__myfs_write_implem(b->fsptr,b->fssize,&b->err,"/pipe",b->buf,rc,0)!=(int)rc) fail(b,"fill","/pipe");
+	if(__myfs_write_implem(b->fsptr,b->fssize,&b->err,"/pipe",b->buf,rc,2*rc)!=(int)rc) fail(b,"fill","/pipe");
+	
+	pipefill(b,fds[1],rc);
+	if(__myfs_writebuf_implem(b->fsptr,b->fssize,&b->err,"/pipe",0,fds[1],rc,rc/2)!=-1) fail(b,"badpipe","/pipe");
+	if(__myfs_writebuf_implem(b->fsptr,b->fssize,&b->err,"/pipe",0,fds[1],2*rc,rc*5/2)!=-1) fail(b,"badpipe","/pipe");
+	if(__myfs_read_implem(b->fsptr,b->fssize,&b->err,"/pipe",back,4*rc,0)!=(int)(3*rc)) fail(b,"badpipe","/pipe");
+	for(i=0;i<rc && back[rc+i]==0;i++);
+	if(memcmp(back,b->buf,rc) || i<rc || memcmp(back+2*rc,b->buf,rc)){
+		b->err=EIO;
+		fail(b,"badpipe","/pipe");
+	}free(back);
+	
+	if((chunks=b->fssize/4/rc)==0) chunks=1;
+	start=now();
+	for(i=0,bytes=0;i<b->ops;i++,bytes+=rc){
+		if(TIMED(b,i,__myfs_writebuf_implem(b->fsptr,b->fssize,&b->err,"/pipe",0,fds[0],rc,rnd(b)%chunks*rc))!=(int)rc){
+			fail(b,"writebuf","/pipe");
+		}pipefill(b,fds[1],rc);
+	}report(b,"writebuf",b->ops,bytes,now()-start);
+	close(fds[0]);
+	close(fds[1]);
+}
+
+//Every lookup walks the whole chain, so this shows the per-component cost of path resolution
+void wdeep(bench *b)
+{
+	struct stat st;
+	char *path=malloc(b->depth*PATH_LEN+PATH_LEN), **names;
+	size_t i, len=0;
+	uint64_t start;
+	int count;
+
+	if(path==NULL){
+		b->err=ENOMEM;
+		fail(b,"alloc","-");
+	}
+
+	start=now();
+	for(i=0;i<b->depth;i++){
+		len+=sprintf(path+len,"/level%zu",i);
+		if(TIMED(b,i,__myfs_mkdir_implem(b->fsptr,b->fssize,&b->err,path))==-1) fail(b,"mkdir",path);
+	}report(b,"mkdir",b->depth,0,now()-start);
+
+	start=now();
+	for(i=0;i<b->ops;i++){
+		if(TIMED(b,i,__myfs_getattr_implem(b->fsptr,b->fssize,&b->err,0,0,path,&st))==-1) fail(b,"getattr",path);
+	}report(b,"getattr",b->ops,0,now()-start);
+
+	start=now();
+	for(i=0;i<b->ops;i++){
+		sprintf(path+len,"/f%zu",i);
+		if(TIMED(b,i,__myfs_mknod_implem(b->fsptr,b->fssize,&b->err,path))==-1) fail(b,"mknod",path);
+	}report(b,"mknod",b->ops,0,now()-start);
+
+	path[len]='\0';
+	start=now();
+	for(i=0;i<READDIRS;i++){
+		if((count=TIMED(b,i,__myfs_readdir_implem(b->fsptr,b->fssize,&b->err,path,&names)))==-1) fail(b,"readdir",path);
+		while(count>0) free(names[--count]);
+		if(b->ret>0) free(names);
+	}report(b,"readdir",READDIRS,0,now()-start);
+	flush(b);
+
+	start=now();
+	for(i=0;i<b->ops;i++){
+		sprintf(path+len,"/f%zu",i);
+		if(TIMED(b,i,__myfs_unlink_implem(b->fsptr,b->fssize,&b->err,path))==-1) fail(b,"unlink",path);
+	}report(b,"unlink",b->ops,0,now()-start);
+	free(path);
+}
+
+//Entries are looked up in random order, so the cost of finding one name among many is not hidden by locality
+void wbigdir(bench *b)
+{
+	struct stat st;
+	char path[PATH_LEN], to[PATH_LEN], **names;
+	size_t i;
+	uint64_t start;
+	int count;
+
+	if(__myfs_mkdir_implem(b->fsptr,b->fssize,&b->err,"/big")==-1) fail(b,"mkdir","/big");
+
+	start=now();
+	for(i=0;i<b->ops;i++){
+		snprintf(path,PATH_LEN,"/big/entry-%08zu",i);
+		if(TIMED(b,i,__myfs_mknod_implem(b->fsptr,b->fssize,&b->err,path))==-1) fail(b,"mknod",path);
+	}report(b,"mknod",b->ops,0,now()-start);
+
+	start=now();
+	for(i=0;i<b->ops;i++){
+		snprintf(path,PATH_LEN,"/big/entry-%08zu",(size_t)(rnd(b)%b->ops));
+		if(TIMED(b,i,__myfs_getattr_implem(b->fsptr,b->fssize,&b->err,0,0,path,&st))==-1) fail(b,"getattr",path);
+	}report(b,"getattr",b->ops,0,now()-start);
+
+	start=now();
+	for(i=0;i<READDIRS;i++){
+		if((count=TIMED(b,i,__myfs_readdir_implem(b->fsptr,b->fssize,&b->err,"/big",&names)))==-1) fail(b,"readdir","/big");
+		while(count>0) free(names[--count]);
+		if(b->ret>0) free(names);
+	}report(b,"readdir",READDIRS,0,now()-start);
+
+	start=now();
+	for(i=0;i<b->ops;i++){
+		snprintf(path,PATH_LEN,"/big/entry-%08zu",i);
+		snprintf(to,PATH_LEN,"/big/moved-%08zu",i);
+		if(TIMED(b,i,__myfs_rename_implem(b->fsptr,b->fssize,&b->err,path,to))==-1) fail(b,"rename",path);
+	}report(b,"rename",b->ops,0,now()-start);
+	flush(b);
+
+	start=now();
+	for(i=0;i<b->ops;i++){
+		snprintf(path,PATH_LEN,"/big/moved-%08zu",i);
+		if(TIMED(b,i,__myfs_unlink_implem(b->fsptr,b->fssize,&b->err,path))==-1) fail(b,"unlink",path);
+	}report(b,"unlink",b->ops,0,now()-start);
+
+	start=now();
+	if(TIMED(b,0,__myfs_rmdir_implem(b->fsptr,b->fssize,&b->err,"/big"))==-1) fail(b,"rmdir","/big");
+	report(b,"rmdir",1,0,now()-start);
+}
+
+typedef struct {
+	bench b;
+	pthread_t tid;
+	size_t bytes;
+} worker;
+
+//One thread of the stress run. Names are drawn from a small set so that threads keep meeting on the same files and
+//directories: an op may then find its file gone or already there, or the image full, and nothing else
+void *stressrun(void *arg)
+{
+	worker *w=arg;
+	bench *b=&w->b;
+	char path[PATH_LEN], **names;
+	const char *phase;
+	size_t i, dir, off, len;
+	int op, ok, count;
+	
+	for(i=0;i<b->ops;i++){
+		op=rnd(b)%100;
+		dir=rnd(b)%DIRS_STRESS;
+		snprintf(path,PATH_LEN,"/s%zu/f%zu",dir,(size_t)(rnd(b)%FILES_STRESS));
+		off=rnd(b)%(4*b->small);
+		len=1+rnd(b)%b->small;
+		if(op<20){
+			phase="mknod";
+			ok=(TIMED(b,i,__myfs_mknod_implem(b->fsptr,b->fssize,&b->err,path))==0 || b->err==EEXIST || b->err==ENOSPC);
+		}else if(op<45){
+			phase="write";
+			ok=(TIMED(b,i,__myfs_write_implem(b->fsptr,b->fssize,&b->err,path,b->buf,len,off))==(int)len
+				|| (b->ret==-1 && (b->err==ENOENT || b->err==ENOSPC)));
+			if(b->ret>0) w->bytes+=b->ret;
+		}else if(op<55){
+			phase="truncate";
+			ok=(TIMED(b,i,__myfs_truncate_implem(b->fsptr,b->fssize,&b->err,path,off))==0
+				|| b->err==ENOENT || b->err==ENOSPC);
+		}else if(op<70){
+			phase="read";
+			ok=(TIMED(b,i,__myfs_read_implem(b->fsptr,b->fssize,&b->err,path,b->buf,len,off))>=0 || b->err==ENOENT);
+			if(b->ret>(int)len) ok=0;
+			else if(b->ret>0) w->bytes+=b->ret;
+		}else if(op<80){
+			phase="readdir";
+			snprintf(path,PATH_LEN,"/s%zu",dir);
+			ok=((count=TIMED(b,i,__myfs_readdir_implem(b->fsptr,b->fssize,&b->err,path,&names)))>=0);
+			while(count>0) free(names[--count]);
+			if(b->ret>0) free(names);
+		}else if(op<90){
+			phase="unlink";
+			ok=(TIMED(b,i,__myfs_unlink_implem(b->fsptr,b->fssize,&b->err,path))==0 || b->err==ENOENT);
+		}else{
+			struct stat st;
+			
+			phase="getattr";
+			ok=(TIMED(b,i,__myfs_getattr_implem(b->fsptr,b->fssize,&b->err,0,0,path,&st))==0 || b->err==ENOENT);
+		}if(!ok) fail(b,phase,path);
+	}return NULL;
+}
+
+//Threads share the directories and the image, each with its own seed, buffer and slice of the latencies. Afterwards
+//everything is removed, and the free counts have to come back to where they were, reclaim of the orphans included
+void wstress(bench *b)
+{
+	struct statvfs before, after;
+	worker *workers=calloc(b->threads,sizeof(worker));
+	char path[PATH_LEN], **names;
+	size_t t, i, per=b->ops/b->threads, bytes=0;
+	uint64_t start;
+	int count;
+	
+	if(workers==NULL || per==0){
+		b->err=(workers==NULL)?ENOMEM:EINVAL;
+		fail(b,"setup","-");
+	}for(i=0;i<DIRS_STRESS;i++){
+		snprintf(path,PATH_LEN,"/s%zu",i);
+		if(__myfs_mkdir_implem(b->fsptr,b->fssize,&b->err,path)==-1) fail(b,"mkdir",path);
+	}if(__myfs_statfs_implem(b->fsptr,b->fssize,&b->err,&before)==-1) fail(b,"statfs","-");
+	for(t=0;t<b->threads;t++){
+		workers[t].b=*b;
+		workers[t].b.ops=per;
+		workers[t].b.lat=b->lat+t*per;
+		workers[t].b.seed=(b->seed+t*0x9e3779b97f4a7c15ULL)|1;
+		if((workers[t].b.buf=malloc(b->small))==NULL){
+			b->err=ENOMEM;
+			fail(b,"setup","-");
+		}for(i=0;i<b->small;i++) workers[t].b.buf[i]=rnd(&workers[t].b);
+	}
+	
+	start=now();
+	for(t=0;t<b->threads;t++){
+		if((errno=pthread_create(&workers[t].tid,NULL,stressrun,&workers[t]))!=0){
+			b->err=errno;
+			fail(b,"thread","-");
+		}
+	}for(t=0;t<b->threads;t++){
+		pthread_join(workers[t].tid,NULL);
+		bytes+=workers[t].bytes;
+		free(workers[t].b.buf);
+	}report(b,"mixed",per*b->threads,bytes,now()-start);
+	free(workers);
+	flush(b);
+	
+	for(i=0;i<DIRS_STRESS;i++){
+		snprintf(path,PATH_LEN,"/s%zu",i);
+		if((count=__myfs_readdir_implem(b->fsptr,b->fssize,&b->err,path,&names))==-1) fail(b,"readdir",path);
+		if(count==0) continue;
+		while(count>0){
+			snprintf(path,PATH_LEN,"/s%zu/%s",i,names[--count]);
+			if(__myfs_unlink_implem(b->fsptr,b->fssize,&b->err,path)==-1) fail(b,"unlink",path);
+			free(names[count]);
+		}free(names);
+	}//Unlinked files are only reclaimed by a sync; without a backup-file it msyncs the anonymous mapping, a no-op
+	if(__myfs_flush_implem(b->fsptr,b->fssize,&b->err,b->fd)==-1) fail(b,"flush","-");
+	if(__myfs_statfs_implem(b->fsptr,b->fssize,&b->err,&after)==-1) fail(b,"statfs","-");
+	if(after.f_bfree!=before.f_bfree || after.f_ffree!=before.f_ffree){
+		fprintf(stderr,"fsbench: stress leaked %lld blocks and %lld inodes\n",(long long)before.f_bfree-(long long)after.f_bfree,
+			(long long)before.f_ffree-(long long)after.f_ffree);
+		exit(1);
+	}
+}
+
+typedef struct {
+	const char *name;
+	void (*run)(bench*);
+} workload;
+
+const workload workloads[]={{"create",wcreate},{"seq",wseq},{"rand",wrand},{"pipe",wpipe},{"deep",wdeep},{"bigdir",wbigdir},{"stress",wstress}};
+#define WORKLOADS (sizeof(workloads)/sizeof(workloads[0]))
+
+int usage(const char *prog)
+{
+	fprintf(stderr,"usage: %s [-s MB] [-f backup-file] [-n ops] [-c seq chunk] [-r random chunk] [-z small file size]"
+		" [-d depth] [-t threads] [-S seed] [create|seq|rand|pipe|deep|bigdir|stress]...\n",prog);
+	return 2;
+}
+
+int main(int argc, char **argv)
+{
+	bench b={.fd=-1,.ops=10000,.seqchunk=131072,.randchunk=4096,.small=1024,.depth=64,.threads=8,
+		.seed=88172645463325252ULL};
+	size_t mb=256, i, max;
+	const char *file=NULL;
+	int opt, w, all;
+
+	while((opt=getopt(argc,argv,"s:f:n:c:r:z:d:t:S:"))!=-1){
+		switch(opt){
+			case 's': mb=strtoull(optarg,NULL,0); break;
+			case 'f': file=optarg; break;
+			case 'n': b.ops=strtoull(optarg,NULL,0); break;
+			case 'c': b.seqchunk=strtoull(optarg,NULL,0); break;
+			case 'r': b.randchunk=strtoull(optarg,NULL,0); break;
+			case 'z': b.small=strtoull(optarg,NULL,0); break;
+			case 'd': b.depth=strtoull(optarg,NULL,0); break;
+			case 't': b.threads=strtoull(optarg,NULL,0); break;
+			case 'S': b.seed=strtoull(optarg,NULL,0)|1; break;
+			default: return usage(argv[0]);
+		}
+	}if(mb==0 || b.ops==0 || b.seqchunk==0 || b.randchunk==0 || b.small==0 || b.depth==0 || b.threads==0) return usage(argv[0]);
+	for(i=optind;i<(size_t)argc;i++){
+		for(w=0;w<(int)WORKLOADS && strcmp(argv[i],workloads[w].name);w++);
+		if(w==(int)WORKLOADS) return usage(argv[0]);
+	}
+
+	b.fssize=mb<<20;
+	if(file!=NULL && (b.fd=open(file,O_RDWR|O_CREAT,0644))==-1){
+		perror(file);
+		return 1;
+	}max=(b.seqchunk>b.randchunk)?b.seqchunk:b.randchunk;
+	if(b.small>max) max=b.small;
+	b.buf=malloc(max);
+	b.lat=malloc(((b.ops>b.depth)?b.ops:b.depth)*sizeof(uint64_t)+READDIRS*sizeof(uint64_t));
+	if(b.buf==NULL || b.lat==NULL){
+		perror("malloc");
+		return 1;
+	}for(i=0;i<max;i++) b.buf[i]=rnd(&b);
+
+	all=(optind==argc);
+	for(w=0;w<(int)WORKLOADS;w++){
+		for(i=optind;i<(size_t)argc && strcmp(argv[i],workloads[w].name);i++);
+		if(!all && i==(size_t)argc) continue;
+		b.work=workloads[w].name;
+		if(fresh(&b)==-1){
+			perror("fsbench: image");
+			return 1;
+		}workloads[w].run(&b);
+	}
+
+	if(b.fsptr!=NULL) munmap(b.fsptr,b.fssize);
+	if(b.fd>=0) close(b.fd);
+	free(b.buf);
+	free(b.lat);
+	return 0;
+}
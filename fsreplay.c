@@ -0,0 +1,365 @@
+/*
+
+  fsreplay: plays back a trace recorded with __myfs_trace_implem,
+  calling the __myfs_*_implem functions in process against a fresh
+  anonymous image or a private copy of a snapshot. Calls are made one
+  at a time in the order they returned when recorded, so the same trace
+  on the same image always makes the same calls; those that overlapped
+  when recorded may see each other's effects in another order, and are
+  the usual cause of results that differ from the trace.
+
+  gcc -Wall -O2 fsreplay.c implementation.c -lpthread -o fsreplay
+
+  fsreplay [-s MB | -f image] [-w scratch-file] [-p] trace
+
+  With -p each call waits for its recorded start time, keeping the
+  original pace; otherwise calls go as fast as they can. A snapshot is
+  mapped copy-on-write and never changed. Handles are mapped from the
+  recorded ones to those the replay is given, and write_buf calls are
+  fed through a pipe like FUSE does. Flushes and checkpoints write to
+  a scratch backup-file, so the replay does their I/O too: the one
+  given with -w, which is truncated first, or an unnamed temporary file
+  otherwise. Prints one JSON line per operation
+  with its count, bytes, time spent and latency percentiles in
+  nanoseconds, then a total line with the wall time and how many calls
+  returned something other than what was recorded. A trace recorded
+  under another format version than the one in myfs_trace.h is refused.
+
+*/
+
+#define _GNU_SOURCE
+#include <errno.h>
+#include <fcntl.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <sys/statvfs.h>
+#include <sys/types.h>
+#include <time.h>
+#include <unistd.h>
+#include "myfs_trace.h"
+
+int __myfs_getattr_implem(void *fsptr, size_t fssize, int *errnoptr, uid_t uid, gid_t gid, const char *path, struct stat *stbuf);
+int __myfs_readdir_implem(void *fsptr, size_t fssize, int *errnoptr, const char *path, char ***namesptr);
+int __myfs_mknod_implem(void *fsptr, size_t fssize, int *errnoptr, const char *path);
+int __myfs_unlink_implem(void *fsptr, size_t fssize, int *errnoptr, const char *path);
+int __myfs_rmdir_implem(void *fsptr, size_t fssize, int *errnoptr, const char *path);
+int __myfs_mkdir_implem(void *fsptr, size_t fssize, int *errnoptr, const char *path);
+int __myfs_rename_implem(void *fsptr, size_t fssize, int *errnoptr, const char *from, const char *to);
+int __myfs_truncate_implem(void *fsptr, size_t fssize, int *errnoptr, const char *path, off_t offset);
+int __myfs_openfh_implem(void *fsptr, size_t fssize, int *errnoptr, const char *path, uint64_t *fh);
+int __myfs_release_implem(void *fsptr, size_t fssize, int *errnoptr, uint64_t fh);
+int __myfs_readfh_implem(void *fsptr, size_t fssize, int *errnoptr, const char *path, uint64_t fh, char *buf, size_t size, off_t off);
+int __myfs_writefh_implem(void *fsptr, size_t fssize, int *errnoptr, const char *path, uint64_t fh, const char *buf, size_t size, off_t off);
+int __myfs_writebuf_implem(void *fsptr, size_t fssize, int *errnoptr, const char *path, uint64_t fh, int fd, size_t size, off_t off);
+off_t __myfs_lseek_implem(void *fsptr, size_t fssize, int *errnoptr, const char *path, off_t off, int whence);
+int __myfs_utimens_implem(void *fsptr, size_t fssize, int *errnoptr, const char *path, const struct timespec ts[2]);
+int __myfs_statfs_implem(void *fsptr, size_t fssize, int *errnoptr, struct statvfs *stbuf);
+int __myfs_flush_implem(void *fsptr, size_t fssize, int *errnoptr, int fd);
+int __myfs_checkpoint_implem(void *fsptr, size_t fssize, int *errnoptr, int fd, unsigned interval);
+
+#define PIPE_MAX (1<<20)
+
+typedef struct {
+	uint64_t *lat;
+	size_t count, cap;
+	uint64_t bytes, ns;
+} oplat;
+
+typedef struct {
+	uint64_t from, to;
+} fhmap;
+
+typedef struct {
+	void *fsptr;
+	size_t fssize;
+	int err;
+	char *buf;
+	size_t buflen;
+	int pipe[2];
+	size_t pipecap;
+	int scratch;
+	fhmap *fhs;
+	size_t nfh, fhcap;
+	oplat ops[OPS];
+	size_t diverged;
+} replay;
+
+uint64_t now(void)
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC,&ts);
+	return (uint64_t)ts.tv_sec*1000000000+ts.tv_nsec;
+}
+void waituntil(uint64_t when)
+{
+	struct timespec ts={when/1000000000,when%1000000000};
+
+	while(clock_nanosleep(CLOCK_MONOTONIC,TIMER_ABSTIME,&ts,NULL)==EINTR);
+}
+
+//Recorded handles live until their release; one never recorded, or whose open failed here, falls back to the path
+uint64_t fhget(replay *r, uint64_t from)
+{
+	size_t i;
+
+	for(i=0;i<r->nfh;i++) if(r->fhs[i].from==from) return r->fhs[i].to;
+	return 0;
+}
+void fhput(replay *r, uint64_t from, uint64_t to)
+{
+	fhmap *fhs;
+
+	if(r->nfh==r->fhcap){
+		if((fhs=realloc(r->fhs,(r->fhcap*2+16)*sizeof(fhmap)))==NULL) return;
+		r->fhs=fhs;
+		r->fhcap=r->fhcap*2+16;
+	}r->fhs[r->nfh].from=from;
+	r->fhs[r->nfh++].to=to;
+}
+void fhdrop(replay *r, uint64_t from)
+{
+	size_t i;
+
+	for(i=0;i<r->nfh;i++){
+		if(r->fhs[i].from==from){
+			r->fhs[i]=r->fhs[--r->nfh];
+			return;
+		}
+	}
+}
+
+//Written data is a fixed pattern; only sizes and offsets are in the trace
+char *bufget(replay *r, size_t size)
+{
+	char *buf;
+
+	if(size>r->buflen){
+		if((buf=realloc(r->buf,size))==NULL) return NULL;
+		memset(buf+r->buflen,0xa5,size-r->buflen);
+		r->buf=buf;
+		r->buflen=size;
+	}return r->buf;
+}
+//Fills the pipe with size bytes for write_buf, or gives -1 when it cannot hold them and the call goes through writefh
+int pipefill(replay *r, size_t size)
+{
+	char drain[4096];
+	ssize_t ct;
+	size_t done;
+
+	while(read(r->pipe[0],drain,sizeof(drain))>0);
+	if(size>r->pipecap || bufget(r,size)==NULL) return -1;
+	for(done=0;done<size;done+=ct){
+		if((ct=write(r->pipe[1],r->buf+done,size-done))<=0) return -1;
+	}return 0;
+}
+
+int64_t play(replay *r, trrec *rec, const char *path, const char *to)
+{
+	struct timespec ts[2];
+	struct statvfs sv;
+	struct stat st;
+	char **names;
+	uint64_t fh;
+	int64_t ret;
+	int cnt;
+
+	switch(rec->op){
+		case OP_GETATTR: return __myfs_getattr_implem(r->fsptr,r->fssize,&r->err,0,0,path,&st);
+		case OP_READDIR:
+			if((ret=__myfs_readdir_implem(r->fsptr,r->fssize,&r->err,path,&names))>0){
+				for(cnt=0;cnt<ret;cnt++) free(names[cnt]);
+				free(names);
+			}return ret;
+		case OP_MKNOD: return __myfs_mknod_implem(r->fsptr,r->fssize,&r->err,path);
+		case OP_UNLINK: return __myfs_unlink_implem(r->fsptr,r->fssize,&r->err,path);
+		case OP_RMDIR: return __myfs_rmdir_implem(r->fsptr,r->fssize,&r->err,path);
+		case OP_MKDIR: return __myfs_mkdir_implem(r->fsptr,r->fssize,&r->err,path);
+		case OP_RENAME: return __myfs_rename_implem(r->fsptr,r->fssize,&r->err,path,to);
+		case OP_TRUNCATE: return __myfs_truncate_implem(r->fsptr,r->fssize,&r->err,path,rec->off);
+		case OP_OPEN:
+			if(!rec->arg) return __myfs_openfh_implem(r->fsptr,r->fssize,&r->err,path,NULL);
+			fh=0;
+			if((ret=__myfs_openfh_implem(r->fsptr,r->fssize,&r->err,path,&fh))==0 && rec->fh!=0 && fh!=0) fhput(r,rec->fh,fh);
+			return ret;
+		case OP_RELEASE:
+			ret=__myfs_release_implem(r->fsptr,r->fssize,&r->err,fhget(r,rec->fh));
+			fhdrop(r,rec->fh);
+			return ret;
+		case OP_READ:
+			if(bufget(r,rec->size)==NULL) break;
+			return __myfs_readfh_implem(r->fsptr,r->fssize,&r->err,path,fhget(r,rec->fh),r->buf,rec->size,rec->off);
+		case OP_WRITEBUF:
+			if(pipefill(r,rec->size)==0){
+				return __myfs_writebuf_implem(r->fsptr,r->fssize,&r->err,path,fhget(r,rec->fh),r->pipe[0],rec->size,rec->off);
+			}//fall through
+		case OP_WRITE:
+			if(bufget(r,rec->size)==NULL) break;
+			return __myfs_writefh_implem(r->fsptr,r->fssize,&r->err,path,fhget(r,rec->fh),r->buf,rec->size,rec->off);
+		case OP_LSEEK: return __myfs_lseek_implem(r->fsptr,r->fssize,&r->err,path,rec->off,rec->arg);
+		case OP_UTIMENS:
+			ts[0].tv_sec=rec->off;
+			ts[0].tv_nsec=rec->fh>>32;
+			ts[1].tv_sec=rec->size;
+			ts[1].tv_nsec=rec->fh&0xffffffff;
+			return __myfs_utimens_implem(r->fsptr,r->fssize,&r->err,path,ts);
+		case OP_STATFS: return __myfs_statfs_implem(r->fsptr,r->fssize,&r->err,&sv);
+		case OP_FLUSH: return __myfs_flush_implem(r->fsptr,r->fssize,&r->err,r->scratch);
+		case OP_CHECKPOINT: return __myfs_checkpoint_implem(r->fsptr,r->fssize,&r->err,r->scratch,rec->arg);
+	}r->err=ENOMEM;
+	return -1;
+}
+
+int cmplat(const void *a, const void *b)
+{
+	uint64_t x=*(const uint64_t*)a, y=*(const uint64_t*)b;
+	return (x>y)-(x<y);
+}
+uint64_t pct(oplat *op, unsigned permille)
+{
+	return op->lat[(op->count-1)*permille/1000];
+}
+void report(replay *r)
+{
+	const char *names[OPS]=OP_NAMES;
+	oplat *op;
+	int i;
+
+	for(i=0;i<OPS;i++){
+		if((op=&r->ops[i])->count==0) continue;
+		qsort(op->lat,op->count,sizeof(uint64_t),cmplat);
+		printf("{\"op\":\"%s\",\"ops\":%zu,\"bytes\":%llu,\"busy_s\":%.6f,\"p50_ns\":%llu,\"p90_ns\":%llu,\"p99_ns\":%llu,"
+			"\"p999_ns\":%llu,\"max_ns\":%llu}\n",names[i],op->count,(unsigned long long)op->bytes,op->ns/1e9,
+			(unsigned long long)pct(op,500),(unsigned long long)pct(op,900),(unsigned long long)pct(op,990),
+			(unsigned long long)pct(op,999),(unsigned long long)op->lat[op->count-1]);
+	}
+}
+
+void record(replay *r, int op, uint64_t ns, int64_t ret)
+{
+	oplat *st=&r->ops[op];
+	uint64_t *lat;
+
+	if(st->count==st->cap){
+		if((lat=realloc(st->lat,(st->cap*2+1024)*sizeof(uint64_t)))==NULL) return;
+		st->lat=lat;
+		st->cap=st->cap*2+1024;
+	}st->lat[st->count++]=ns;
+	st->ns+=ns;
+	if(ret>0 && (op==OP_READ || op==OP_WRITE || op==OP_WRITEBUF)) st->bytes+=ret;
+}
+
+int usage(const char *prog)
+{
+	fprintf(stderr,"usage: %s [-s MB | -f image] [-w scratch-file] [-p] trace\n",prog);
+	return 2;
+}
+
+int main(int argc, char **argv)
+{
+	replay r={.pipe={-1,-1},.scratch=-1};
+	struct stat st;
+	trhead head;
+	trrec rec;
+	char *trace, *path, *to;
+	const char *image=NULL, *scratch=NULL;
+	FILE *tmp=NULL;
+	size_t mb=256, len, pos, calls=0;
+	uint64_t base, start, ns;
+	int64_t ret;
+	int opt, fd, pace=0;
+
+	while((opt=getopt(argc,argv,"s:f:w:p"))!=-1){
+		switch(opt){
+			case 's': mb=strtoull(optarg,NULL,0); break;
+			case 'f': image=optarg; break;
+			case 'w': scratch=optarg; break;
+			case 'p': pace=1; break;
+			default: return usage(argv[0]);
+		}
+	}if(optind!=argc-1 || mb==0) return usage(argv[0]);
+
+	if((fd=open(argv[optind],O_RDONLY))==-1 || fstat(fd,&st)==-1){
+		perror(argv[optind]);
+		return 1;
+	}len=st.st_size;
+	if(len<sizeof(trhead) || (trace=mmap(NULL,len,PROT_READ,MAP_PRIVATE,fd,0))==MAP_FAILED){
+		fprintf(stderr,"fsreplay: %s: not a trace\n",argv[optind]);
+		return 1;
+	}close(fd);
+	memcpy(&head,trace,sizeof(trhead));
+	if(head.magic!=TRACE_MAGIC){
+		fprintf(stderr,"fsreplay: %s: not a trace\n",argv[optind]);
+		return 1;
+	}if(head.version!=TRACE_VERSION || head.reclen!=sizeof(trrec)){
+		fprintf(stderr,"fsreplay: %s: trace format %u, this fsreplay reads %u\n",argv[optind],head.version,TRACE_VERSION);
+		return 1;
+	}
+
+	if(image!=NULL){
+		if((fd=open(image,O_RDONLY))==-1 || fstat(fd,&st)==-1){
+			perror(image);
+			return 1;
+		}r.fssize=st.st_size;
+		r.fsptr=mmap(NULL,r.fssize,PROT_READ|PROT_WRITE,MAP_PRIVATE,fd,0);
+		close(fd);
+	}else{
+		r.fssize=mb<<20;
+		r.fsptr=mmap(NULL,r.fssize,PROT_READ|PROT_WRITE,MAP_PRIVATE|MAP_ANONYMOUS,-1,0);
+	}if(r.fsptr==MAP_FAILED){
+		perror("fsreplay: image");
+		return 1;
+	}if(pipe2(r.pipe,O_NONBLOCK)==-1){
+		perror("fsreplay: pipe");
+		return 1;
+	}fcntl(r.pipe[1],F_SETPIPE_SZ,PIPE_MAX);
+	r.pipecap=fcntl(r.pipe[1],F_GETPIPE_SZ);
+	if(scratch!=NULL) r.scratch=open(scratch,O_RDWR|O_CREAT|O_TRUNC,0644);
+	else if((tmp=tmpfile())!=NULL) r.scratch=dup(fileno(tmp));
+	if(r.scratch==-1 || ftruncate(r.scratch,r.fssize)==-1){
+		perror((scratch!=NULL)?scratch:"fsreplay: scratch file");
+		return 1;
+	}if(tmp!=NULL) fclose(tmp);
+
+	base=now();
+	for(pos=sizeof(trhead);pos+sizeof(trrec)<=len;pos+=rec.len){
+		memcpy(&rec,trace+pos,sizeof(trrec));
+		if(rec.len<sizeof(trrec) || rec.len>len-pos || rec.op>OP_CHECKPOINT
+			|| (rec.len>sizeof(trrec) && trace[pos+rec.len-1]!='\0')){
+			fprintf(stderr,"fsreplay: %s: bad record at %zu\n",argv[optind],pos);
+			break;
+		}path=(rec.len>sizeof(trrec))?trace+pos+sizeof(trrec):NULL;
+		to=(path!=NULL && rec.op==OP_RENAME)?path+strlen(path)+1:NULL;
+		if(path==NULL && rec.op!=OP_RELEASE && rec.op!=OP_STATFS && rec.op!=OP_FLUSH && rec.op!=OP_CHECKPOINT) continue;
+		if(rec.op==OP_RENAME && to>=trace+pos+rec.len) continue;
+
+		if(pace) waituntil(base+rec.start);
+		start=now();
+		ret=play(&r,&rec,path,to);
+		ns=now()-start;
+		record(&r,rec.op,ns,ret);
+		//flushes write however much was dirty, which depends on when the last one ran
+		if(rec.op!=OP_FLUSH && (ret!=rec.ret || (ret<0 && r.err!=rec.err))) r.diverged++;
+		calls++;
+	}
+
+	report(&r);
+	ns=now()-base;
+	printf("{\"op\":\"total\",\"ops\":%zu,\"secs\":%.6f,\"ops_s\":%.1f,\"diverged\":%zu}\n",calls,ns/1e9,
+		(ns>0)?calls/(ns/1e9):0,r.diverged);
+
+	for(opt=0;opt<OPS;opt++) free(r.ops[opt].lat);
+	free(r.fhs);
+	free(r.buf);
+	close(r.pipe[0]);
+	close(r.pipe[1]);
+	close(r.scratch);
+	munmap(r.fsptr,r.fssize);
+	munmap(trace,len);
+	return 0;
+}
@@ -218,503 +218,2274 @@
 */
 
 #include "myfs_helper.h"
+#include "myfs_trace.h"
+#include <limits.h>
+#include <pthread.h>
+#include <sched.h>
+#include <stddef.h>
+#include <stdint.h>
+#include <sys/auxv.h>
+#include <sys/ioctl.h>
+#include <sys/mman.h>
+#include <sys/uio.h>
+#include <unistd.h>
+
+#define FSMETA_MAGIC ((size_t)0x317478455346794dULL)
+#define EXTS_NODE 4
+#define EXTS_BLOCK ((BLKSZ-sizeof(exthdr))/sizeof(extent))
+#define EXT_MAXDEPTH 8
+#define SLOTS_BLOCK (BLKSZ/sizeof(dirslot))
+#define DIRHASH_MIN 32
+#define DIRREC_LEN(len) ((offsetof(dirrec,name)+(len)+8)&~(size_t)7)
+#define DCACHE_NAMELEN 96
+#define DCACHE_MAX 4096
+#define FILES_OPEN 256
+#define PREALLOC_MIN 8
+#define PREALLOC_MAX 256
+#define RECLAIM_STEP 4096
+#define INLINE_MAX sizeof(extroot)
+#define NODE_LOCKS 256
+#define DCACHE_LOCKS 64
+#define OFILE_LOCKS 16
+#define GROUP_BLOCKS 4096
+#define IOVS_MAX 64
+#define FLUSH_GAP 16
+#define LOG_MAGIC ((size_t)0x676f4c6c616e724aULL)
+#define LOG_MIN 16
+#define LOG_MAX 1024
+#define STAT_BUCKETS 32
+#define OP_FREALLOC OPS
+#define STAT_OPS (OPS+1)
+#define STATS_PATH "/.myfs-stats"
+#define STATS_LEN 32768
+#define CT_PATH2NODE 0
+#define CT_PATHWALK 1
+#define CT_DIRMOD 2
+#define CT_DIRSCAN 3
+#define CT_ADVANCE 4
+#define CT_ADVBLKS 5
+#define CT_FLUSHED 6
+#define CT_LOGGED 7
+#define CT_TRDROP 8
+#define CTRS 9
+#ifndef SEEK_DATA
+#define SEEK_DATA 3
+#define SEEK_HOLE 4
+#endif
+
+typedef struct {
+	sz_blk lblk;
+	blkset start;
+	sz_blk len;
+} extent;
+
+typedef struct {
+	sz_blk count;
+	sz_blk depth;
+} exthdr;
+
+typedef struct {
+	exthdr hdr;
+	extent exts[EXTS_NODE];
+} extroot;
+
+typedef struct {
+	uint32_t hash;
+	uint32_t entry;
+} dirslot;
+
+typedef struct {
+	uint32_t used;
+	uint32_t count;
+} dirblk;
+
+typedef struct {
+	nodei node;
+	uint16_t len;
+	uint16_t namelen;
+	char name[];
+} dirrec;
+
+typedef struct {
+	extroot map;
+	extroot hmap;
+	sz_blk hsize;
+	nodei nextfree;
+	size_t valid;
+	size_t gen;
+	size_t mapver;
+	blkset resv;
+	sz_blk resvlen;
+} xinode;
+
+typedef struct {
+	uint32_t hash;
+	uint32_t len;
+	nodei parent;
+	nodei node;
+	size_t gen;
+	size_t nodegen;
+	char name[DCACHE_NAMELEN];
+} dentry;
+
+typedef struct {
+	sz_blk pre;
+	sz_blk suf;
+	sz_blk best;
+} bmsum;
+
+typedef struct {
+	blkset start;
+	sz_blk len;
+} blkrun;
+
+typedef struct {
+	blkrun *runs;
+	size_t count;
+	size_t cap;
+} runbuf;
+
+typedef struct {
+	nodei node;
+	size_t gen;
+	size_t mapver;
+	fpos pos;
+} ofile;
+
+typedef struct {
+	pthread_mutex_t orphans;
+	pthread_mutex_t dcache[DCACHE_LOCKS];
+	pthread_mutex_t ofiles[OFILE_LOCKS];
+	pthread_rwlock_t nodes[NODE_LOCKS];
+} fslocks;
+
+typedef struct {
+	pthread_mutex_t lock;
+	sz_blk free;
+	sz_blk reserved;
+	nodei freenode;
+	size_t nodesfree;
+} __attribute__((aligned(64))) agroup;
+
+typedef struct {
+	uint64_t calls;
+	uint64_t errors;
+	uint64_t ns;
+	uint64_t hist[STAT_BUCKETS];
+} __attribute__((aligned(64))) opstat;
+
+typedef struct {
+	opstat ops[STAT_OPS];
+	uint64_t counters[CTRS];
+} fsstats;
+
+typedef struct {
+	size_t magic;
+	uint64_t sum;
+	size_t seq;
+	sz_blk count;
+	blkset blks[];
+} loghdr;
+
+//What a mount keeps for its own process: the descriptors and timers it was handed since. None of it means anything
+//to another process
+typedef struct {
+	int ckfd;
+	size_t ckint;
+	size_t cknext;
+	int trfd;
+	uint64_t trbase;
+} mntinfo;
+
+typedef struct {
+	size_t magic;
+	nodei upgrade;
+	size_t xnodetbl;
+	size_t dcache;
+	size_t dcsize;
+	size_t dgen;
+	size_t dhits;
+	size_t dmisses;
+	blkset metablk;
+	size_t bitmap;
+	size_t bmtree;
+	size_t bmleaves;
+	size_t mounts;
+	size_t ofiles;
+	size_t ofnext;
+	nodei orphans;
+	sz_blk pending;
+	size_t locks;
+	size_t groups;
+	size_t ngroups;
+	size_t dirty;
+	size_t jmap;
+	size_t stats;
+	sz_blk jdirty;
+	size_t jseq;
+	int jpend;
+	int jlive;
+	mntinfo mnt;
+} fsmeta;
+
+size_t dcachesize(fsheader *fshead)
+{
+	size_t dcsize=16;
+	while(dcsize<DCACHE_MAX && 8*dcsize<fshead->ntsize*NODES_BLOCK) dcsize*=2;
+	return dcsize;
+}
+
+size_t leafcount(fsheader *fshead)
+{
+	size_t leaves=1;
+	while(leaves<CLDIV(fshead->size,64)) leaves*=2;
+	return leaves;
+}
+
+//Groups split the blocks into aligned spans of GROUP_BLOCKS, each under its own subtree of the bitmap summaries
+size_t groupcount(fsheader *fshead)
+{
+	size_t blocks=64*leafcount(fshead);
+	return (blocks>GROUP_BLOCKS)?blocks/GROUP_BLOCKS:1;
+}
+
+//The log takes a share of the image, split into two slots, and sits just below the meta header so that it can be
+//found at mount before anything else is trusted
+sz_blk logsize(fsheader *fshead)
+{
+	sz_blk len=fshead->size/64;
+	return ((len<LOG_MIN)?LOG_MIN:MIN(len,LOG_MAX))&~(sz_blk)1;
+}
+
+sz_blk metasize(fsheader *fshead)
+{
+	return 1+CLDIV((fshead->ntsize*NODES_BLOCK-1)*sizeof(xinode),BLKSZ)
+		+CLDIV(dcachesize(fshead)*sizeof(dentry),BLKSZ)
+		+CLDIV(CLDIV(fshead->size,64)*sizeof(uint64_t),BLKSZ)
+		+CLDIV(2*leafcount(fshead)*sizeof(bmsum),BLKSZ)
+		+CLDIV(FILES_OPEN*sizeof(ofile),BLKSZ)
+		+CLDIV(sizeof(fslocks),BLKSZ)
+		+CLDIV(groupcount(fshead)*sizeof(agroup),BLKSZ)
+		+2*CLDIV(CLDIV(fshead->size,64)*sizeof(uint64_t),BLKSZ)
+		+CLDIV(sizeof(fsstats),BLKSZ)
+		+logsize(fshead);
+}
+
+//The mount stamp sits in the spare room of the header's inode slot, the one place every image has at a known
+//offset before it is formatted or converted, and which no format has ever used
+_Static_assert(CLDIV(sizeof(fsheader),sizeof(uint64_t))*sizeof(uint64_t)+sizeof(uint64_t)<=sizeof(inode),
+	"no room for the mount stamp in the header slot");
+uint64_t *getstamp(void *fsptr)
+{
+	return O2P(CLDIV(sizeof(fsheader),sizeof(uint64_t))*sizeof(uint64_t));
+}
+
+fsmeta *getmeta(void *fsptr)
+{
+	fsheader *fshead=fsptr;
+	return B2P(fshead->size-1);
+}
+
+xinode *xnodes(void *fsptr)
+{
+	return O2P(getmeta(fsptr)->xnodetbl);
+}
+
+fslocks *getlocks(void *fsptr)
+{
+	return O2P(getmeta(fsptr)->locks);
+}
+
+loghdr *getlog(void *fsptr, int slot)
+{
+	fsheader *fshead=fsptr;
+	return B2P(fshead->size-1-logsize(fshead)+slot*logsize(fshead)/2);
+}
+
+//Counters and timings are kept with relaxed atomics and never marked dirty; they start over on every mount.
+//The stats region sits just below the log and no flush run reaches into either, so it is never written out
+void statcount(void *fsptr, int ctr, uint64_t count)
+{
+	__atomic_fetch_add(&((fsstats*)O2P(getmeta(fsptr)->stats))->counters[ctr],count,__ATOMIC_RELAXED);
+}
+uint64_t opstart(void)
+{
+	struct timespec now;
+	
+	clock_gettime(CLOCK_MONOTONIC,&now);
+	return (uint64_t)now.tv_sec*1000000000+now.tv_nsec;
+}
+//Latencies go in log2 buckets of nanoseconds, the last taking everything slower; calls that never got the image
+//mounted have nowhere to be counted
+uint64_t opdone(void *fsptr, fsmeta *meta, int op, uint64_t start, int failed)
+{
+	opstat *st;
+	uint64_t ns=opstart()-start;
+	int bucket=(ns==0)?0:63-__builtin_clzll(ns);
+	
+	if(meta==NULL) return ns;
+	st=&((fsstats*)O2P(meta->stats))->ops[op];
+	__atomic_fetch_add(&st->calls,1,__ATOMIC_RELAXED);
+	if(failed) __atomic_fetch_add(&st->errors,1,__ATOMIC_RELAXED);
+	__atomic_fetch_add(&st->ns,ns,__ATOMIC_RELAXED);
+	__atomic_fetch_add(&st->hist[(bucket<STAT_BUCKETS)?bucket:STAT_BUCKETS-1],1,__ATOMIC_RELAXED);
+	return ns;
+}
+
+//Blocks changed since the last flush have their bit set in the dirty map, and metadata blocks in the journal map
+//as well. Every change is made under a node lock or the orphan list lock, which a flush takes all of, so a block
+//may be marked any time before its lock is let go; the bit is read first as most marks find it set already
+sz_blk markbits(uint64_t *map, blkset blk, sz_blk count)
+{
+	uint64_t bits, old;
+	blkset end=blk+count;
+	sz_blk added=0;
+	
+	for(;blk<end;blk=(blk/64+1)*64){
+		bits=~(uint64_t)0<<(blk%64);
+		if(end<(blk/64+1)*64) bits&=~(~(uint64_t)0<<(end%64));
+		if((__atomic_load_n(&map[blk/64],__ATOMIC_RELAXED)&bits)!=bits){
+			old=__atomic_fetch_or(&map[blk/64],bits,__ATOMIC_RELAXED);
+			added+=__builtin_popcountll(bits&~old);
+		}
+	}return added;
+}
+void dirty(void *fsptr, blkset blk, sz_blk count)
+{
+	fsmeta *meta=getmeta(fsptr);
+	sz_blk added;
+	
+	markbits(O2P(meta->dirty),blk,count);
+	if((added=markbits(O2P(meta->jmap),blk,count))>0) __atomic_fetch_add(&meta->jdirty,added,__ATOMIC_RELAXED);
+}
+//Pointers outside the image, as to the extent roots built up on the stack, are skipped
+void dirtyptr(void *fsptr, void *ptr, size_t len)
+{
+	fsheader *fshead=fsptr;
+	size_t off=(char*)ptr-(char*)fsptr;
+	
+	if(off<fshead->size*BLKSZ) dirty(fsptr,off/BLKSZ,CLDIV(off+len,BLKSZ)-off/BLKSZ);
+}
+//File data goes straight home and is left out of the log
+void datadirty(void *fsptr, void *ptr, size_t len)
+{
+	size_t off=(char*)ptr-(char*)fsptr;
+	
+	markbits(O2P(getmeta(fsptr)->dirty),off/BLKSZ,CLDIV(off+len,BLKSZ)-off/BLKSZ);
+}
+//An image read back from its backup file matches it, and a new or converted one has nothing there yet
+void dirtyreset(void *fsptr, int all)
+{
+	fsheader *fshead=fsptr;
+	fsmeta *meta=getmeta(fsptr);
+	uint64_t *map=O2P(meta->dirty), *jmap=O2P(meta->jmap);
+	blkset blk;
+	
+	memset(map,all?0xff:0,CLDIV(fshead->size,64)*sizeof(uint64_t));
+	memset(jmap,all?0xff:0,CLDIV(fshead->size,64)*sizeof(uint64_t));
+	meta->jdirty=all?fshead->size:0;
+	//the stats are left out even when everything else goes
+	for(blk=meta->stats/BLKSZ;blk<CLDIV(meta->stats+sizeof(fsstats),BLKSZ);blk++){
+		map[blk/64]&=~((uint64_t)1<<(blk%64));
+		jmap[blk/64]&=~((uint64_t)1<<(blk%64));
+	}
+}
+//First block at or after blk whose bit in map is set, or clear, or the image size if there is none
+blkset dirtyscan(void *fsptr, uint64_t *map, blkset blk, int set)
+{
+	fsheader *fshead=fsptr;
+	uint64_t word;
+	
+	while(blk<fshead->size){
+		word=(set?map[blk/64]:~map[blk/64])&(~(uint64_t)0<<(blk%64));
+		if(word!=0) return MIN(blk/64*64+__builtin_ctzll(word),fshead->size);
+		blk=(blk/64+1)*64;
+	}return fshead->size;
+}
+void nodedirty(void *fsptr, nodei node)
+{
+	fsheader *fshead=fsptr;
+	
+	dirtyptr(fsptr,&((inode*)O2P(fshead->nodetbl))[node],sizeof(inode));
+	dirtyptr(fsptr,&xnodes(fsptr)[node],sizeof(xinode));
+}
+
+//Each group's lock covers its part of the bitmap, the summaries under its subtree, its counts and its free node
+//list; none is ever taken while another is held
+agroup *grouplock(void *fsptr, size_t group, int write)
+{
+	agroup *grp=&((agroup*)O2P(getmeta(fsptr)->groups))[group];
+	
+	pthread_mutex_lock(&grp->lock);
+	if(write) dirtyptr(fsptr,grp,sizeof(agroup));
+	return grp;
+}
+void groupunlock(agroup *grp)
+{
+	pthread_mutex_unlock(&grp->lock);
+}
+sz_blk groupspan(fsmeta *meta)
+{
+	return 64*meta->bmleaves/meta->ngroups;
+}
+//The summary tree is rounded up to a power of two, so the groups past the meta region hold no blocks and are skipped
+size_t livegroups(fsmeta *meta)
+{
+	return CLDIV(meta->metablk,groupspan(meta));
+}
+//Nodes are split over the groups in even ranges, and a node's blocks start out in its group
+size_t nodegroup(void *fsptr, nodei node)
+{
+	fsheader *fshead=fsptr;
+	return node/CLDIV(fshead->ntsize*NODES_BLOCK-1,livegroups(getmeta(fsptr)));
+}
+blkset groupgoal(void *fsptr, nodei node)
+{
+	fsheader *fshead=fsptr;
+	blkset goal=nodegroup(fsptr,node)*groupspan(getmeta(fsptr));
+	
+	return (goal<fshead->ntsize)?fshead->ntsize:goal;
+}
+//Allocations with no block to aim for spread over the groups by thread, so concurrent writers start apart
+size_t threadgroup(void *fsptr)
+{
+	return (size_t)(((uint64_t)pthread_self()*0x9e3779b97f4a7c15ULL)>>32)%livegroups(getmeta(fsptr));
+}
+//Totals are only needed by statfs and by an allocation running short, so they are summed from the groups on demand
+void groupsum(void *fsptr, sz_blk *blks, sz_blk *reserved, size_t *nodes)
+{
+	fsmeta *meta=getmeta(fsptr);
+	agroup *grp;
+	size_t i;
+	
+	*blks=*reserved=*nodes=0;
+	for(i=0;i<livegroups(meta);i++){
+		grp=grouplock(fsptr,i,0);
+		*blks+=grp->free;
+		*reserved+=grp->reserved;
+		*nodes+=grp->nodesfree;
+		groupunlock(grp);
+	}
+}
+
+void bmleaf(bmsum *sum, uint64_t word)
+{
+	if(word==~(uint64_t)0){
+		sum->pre=sum->suf=sum->best=64;
+		return;
+	}sum->pre=__builtin_ctzll(~word);
+	sum->suf=__builtin_clzll(~word);
+	for(sum->best=0;word!=0;sum->best++) word&=word>>1;
+}
+void bmjoin(bmsum *tree, size_t i, sz_blk span)
+{
+	bmsum *l=&tree[2*i], *r=&tree[2*i+1];
+	
+	tree[i].pre=(l->pre==span)?span+r->pre:l->pre;
+	tree[i].suf=(r->suf==span)?span+l->suf:r->suf;
+	tree[i].best=(l->best>r->best)?l->best:r->best;
+	if(l->suf+r->pre>tree[i].best) tree[i].best=l->suf+r->pre;
+}
+//Marks [start,start+len) free or used, returning how many blocks actually changed state
+sz_blk bmbits(void *fsptr, blkset start, sz_blk len, int isfree)
+{
+	fsmeta *meta=getmeta(fsptr);
+	uint64_t *map=O2P(meta->bitmap), mask;
+	size_t lo=start/64, hi=(start+len-1)/64, i;
+	sz_blk changed=0;
+	
+	dirtyptr(fsptr,&map[lo],(hi-lo+1)*sizeof(uint64_t));
+	for(i=lo;i<=hi;i++){
+		mask=~(uint64_t)0;
+		if(i==lo) mask&=~(uint64_t)0<<(start%64);
+		if(i==hi) mask&=~(uint64_t)0>>(63-(start+len-1)%64);
+		if(isfree){
+			changed+=__builtin_popcountll(mask&~map[i]);
+			map[i]|=mask;
+		}else{
+			changed+=__builtin_popcountll(mask&map[i]);
+			map[i]&=~mask;
+		}
+	}return changed;
+}
+//Refreshes the summaries above sorted, disjoint runs of bitmap words, one level at a time, up to the group roots
+void bmsync(void *fsptr, blkrun *words, size_t count)
+{
+	fsmeta *meta=getmeta(fsptr);
+	uint64_t *map=O2P(meta->bitmap);
+	bmsum *tree=O2P(meta->bmtree);
+	sz_blk span=64;
+	size_t i, j, m;
+	
+	for(i=0;i<count;i++){
+		for(j=words[i].start;j<words[i].start+words[i].len;j++) bmleaf(&tree[meta->bmleaves+j],map[j]);
+		words[i].start+=meta->bmleaves;
+		dirtyptr(fsptr,&tree[words[i].start],words[i].len*sizeof(bmsum));
+	}for(;words[0].start>=2*meta->ngroups;span*=2){
+		for(m=0,i=0;i<count;i++){
+			blkset lo=words[i].start/2, hi=(words[i].start+words[i].len-1)/2;
+			if(m>0 && lo<=words[m-1].start+words[m-1].len){
+				words[m-1].len=hi+1-words[m-1].start;
+			}else{
+				words[m].start=lo;
+				words[m++].len=hi+1-lo;
+			}
+		}for(count=m,i=0;i<count;i++){
+			for(j=words[i].start;j<words[i].start+words[i].len;j++) bmjoin(tree,j,span);
+			dirtyptr(fsptr,&tree[words[i].start],words[i].len*sizeof(bmsum));
+		}
+	}
+}
+sz_blk bmmark(void *fsptr, blkset start, sz_blk len, int isfree)
+{
+	blkrun words;
+	sz_blk changed;
+	
+	if(len==0) return 0;
+	changed=bmbits(fsptr,start,len,isfree);
+	words.start=start/64;
+	words.len=(start+len-1)/64+1-words.start;
+	bmsync(fsptr,&words,1);
+	return changed;
+}
+//Finds a free run of len blocks in a group, which the caller has checked exists against the group's root summary
+blkset bmfind(void *fsptr, size_t group, sz_blk len)
+{
+	fsmeta *meta=getmeta(fsptr);
+	uint64_t *map=O2P(meta->bitmap), run;
+	bmsum *tree=O2P(meta->bmtree);
+	sz_blk span=groupspan(meta)/2, k;
+	blkset base=group*groupspan(meta);
+	size_t i=meta->ngroups+group;
+
+	for(;i<meta->bmleaves;span/=2){
+		if(tree[2*i].best>=len){
+			i=2*i;
+		}else if(tree[2*i].suf+tree[2*i+1].pre>=len){
+			return base+span-tree[2*i].suf;
+		}else{
+			i=2*i+1;
+			base+=span;
+		}
+	}for(run=map[i-meta->bmleaves],k=1;k<len;k++) run&=map[i-meta->bmleaves]>>k;
+	return base+__builtin_ctzll(run);
+}
+//Length of the free run starting at start, up to max and never past the end of its group
+sz_blk bmrun(void *fsptr, blkset start, sz_blk max)
+{
+	fsmeta *meta=getmeta(fsptr);
+	uint64_t *map=O2P(meta->bitmap), word;
+	sz_blk len=0, got;
+	
+	max=MIN(max,(start/groupspan(meta)+1)*groupspan(meta)-start);
+	while(len<max){
+		word=~(map[(start+len)/64]>>((start+len)%64));
+		got=word?__builtin_ctzll(word):64;
+		len+=got;
+		if(word && got<64-(start+len-got)%64) break;
+	}return MIN(len,max);
+}
+
+//Takes the largest free runs of one group after another, starting from the given one
+sz_blk blkgroups(void *fsptr, size_t first, sz_blk count, blkset *buf)
+{
+	fsmeta *meta=getmeta(fsptr);
+	bmsum *tree=O2P(meta->bmtree);
+	agroup *grp;
+	sz_blk alloct=0, got, run;
+	blkset start;
+	size_t i, group;
+	
+	for(i=0;i<livegroups(meta) && alloct<count;i++){
+		group=(first+i)%livegroups(meta);
+		grp=grouplock(fsptr,group,1);
+		for(got=alloct;alloct<count && tree[meta->ngroups+group].best>0;){
+			run=MIN(count-alloct,tree[meta->ngroups+group].best);
+			start=bmfind(fsptr,group,run);
+			bmmark(fsptr,start,run,0);
+			while(run-->0) buf[alloct++]=start++;
+		}grp->free-=alloct-got;
+		groupunlock(grp);
+	}return alloct;
+}
+sz_blk blkalloc(void *fsptr, sz_blk count, blkset *buf)
+{
+	return blkgroups(fsptr,threadgroup(fsptr),count,buf);
+}
+
+//LSD radix sort on run starts, one byte per pass, skipped when the runs already arrive in order
+void runsort(blkrun *runs, blkrun *tmp, size_t count, blkset maxblk)
+{
+	size_t ct[256], i, sum, c;
+	unsigned shift;
+	blkrun *src=runs, *dst=tmp, *t;
+	
+	for(i=1;i<count && runs[i-1].start<=runs[i].start;i++);
+	if(i>=count) return;
+	for(shift=0;shift<8*sizeof(blkset) && (maxblk>>shift)!=0;shift+=8){
+		memset(ct,0,sizeof(ct));
+		for(i=0;i<count;i++) ct[(src[i].start>>shift)&255]++;
+		for(sum=0,i=0;i<256;i++){
+			c=ct[i]; ct[i]=sum; sum+=c;
+		}for(i=0;i<count;i++) dst[ct[(src[i].start>>shift)&255]++]=src[i];
+		t=src; src=dst; dst=t;
+	}if(src!=runs) memcpy(runs,src,count*sizeof(blkrun));
+}
+//Frees a batch of runs: sorted, merged, then written to the bitmap and summarized in one pass per group
+sz_blk runsfree(void *fsptr, blkrun *runs, size_t count, blkrun *tmp)
+{
+	fsheader *fshead=fsptr;
+	fsmeta *meta=getmeta(fsptr);
+	blkset end=meta->metablk, lo, hi;
+	blkrun one, *words=(tmp!=NULL)?tmp:&one;
+	sz_blk freect=0, got, span=groupspan(meta);
+	size_t i, n=0;
+	agroup *grp;
+	
+	runsort(runs,tmp,count,end);
+	for(i=0;i<count;i++){
+		lo=(runs[i].start<fshead->ntsize)?fshead->ntsize:runs[i].start;
+		hi=(runs[i].start+runs[i].len>end)?end:runs[i].start+runs[i].len;
+		if(lo>=hi) continue;
+		if(n>0 && lo<=runs[n-1].start+runs[n-1].len){
+			if(hi>runs[n-1].start+runs[n-1].len) runs[n-1].len=hi-runs[n-1].start;
+		}else{
+			runs[n].start=lo;
+			runs[n++].len=hi-lo;
+		}
+	}for(count=n,i=0;i<count;){
+		blkset group=runs[i].start/span;
+		grp=grouplock(fsptr,group,1);
+		for(n=0,got=0;i<count && runs[i].start<(group+1)*span;){
+			hi=MIN(runs[i].start+runs[i].len,(group+1)*span);
+			got+=bmbits(fsptr,runs[i].start,hi-runs[i].start,1);
+			lo=runs[i].start/64;
+			if(n>0 && lo<=words[n-1].start+words[n-1].len){
+				words[n-1].len=(hi-1)/64+1-words[n-1].start;
+			}else{
+				words[n].start=lo;
+				words[n++].len=(hi-1)/64+1-lo;
+			}if(hi<runs[i].start+runs[i].len){
+				runs[i].len-=hi-runs[i].start;
+				runs[i].start=hi;
+			}else i++;
+		}bmsync(fsptr,words,n);
+		grp->free+=got;
+		groupunlock(grp);
+		freect+=got;
+	}return freect;
+}
+sz_blk runfree(void *fsptr, blkset start, sz_blk len)
+{
+	blkrun run;
+	
+	run.start=start;
+	run.len=len;
+	return runsfree(fsptr,&run,1,NULL);
+}
+sz_blk blkfree(void *fsptr, sz_blk count, blkset *buf)
+{
+	blkrun *runs;
+	size_t nruns=0, i;
+	sz_blk freect=0;
+	
+	for(i=0;i<count;i++){
+		if(i==0 || buf[i]!=buf[i-1]+1) nruns++;
+	}if(nruns<=1) return (count>0)?runfree(fsptr,buf[0],count):0;
+	if((runs=malloc(2*nruns*sizeof(blkrun)))==NULL){
+		for(i=0;i<count;i++) freect+=runfree(fsptr,buf[i],1);
+		return freect;
+	}for(nruns=0,i=0;i<count;i++){
+		if(i>0 && buf[i]==buf[i-1]+1) runs[nruns-1].len++;
+		else{
+			runs[nruns].start=buf[i];
+			runs[nruns++].len=1;
+		}
+	}freect=runsfree(fsptr,runs,nruns,&runs[nruns]);
+	free(runs);
+	return freect;
+}
+//Queues a run to go out with the rest of the batch, freeing it on the spot if the batch cannot grow
+void runpush(void *fsptr, runbuf *batch, blkset start, sz_blk len)
+{
+	blkrun *grown;
+	size_t cap;
+	
+	if(len==0) return;
+	if(batch->count>0 && batch->runs[batch->count-1].start+batch->runs[batch->count-1].len==start){
+		batch->runs[batch->count-1].len+=len;
+		return;
+	}if(batch->count>0 && start+len==batch->runs[batch->count-1].start){
+		batch->runs[batch->count-1].start=start;
+		batch->runs[batch->count-1].len+=len;
+		return;
+	}if(batch->count==batch->cap){
+		cap=batch->cap?2*batch->cap:64;
+		if((grown=realloc(batch->runs,2*cap*sizeof(blkrun)))==NULL){
+			runfree(fsptr,start,len);
+			return;
+		}batch->runs=grown;
+		batch->cap=cap;
+	}batch->runs[batch->count].start=start;
+	batch->runs[batch->count++].len=len;
+}
+sz_blk runflush(void *fsptr, runbuf *batch)
+{
+	sz_blk freect=0;
+	
+	if(batch->count>0) freect=runsfree(fsptr,batch->runs,batch->count,&batch->runs[batch->cap]);
+	free(batch->runs);
+	batch->runs=NULL;
+	batch->count=batch->cap=0;
+	return freect;
+}
+//Blocks held past the end of a growing file are marked used, but counted apart so they still show as free. A
+//reservation never crosses a group, and belongs to whoever holds its node's write lock
+void resvdrop(void *fsptr, nodei node)
+{
+	xinode *xn=&xnodes(fsptr)[node];
+	agroup *grp;
+	
+	if(xn->resvlen>0){
+		grp=grouplock(fsptr,xn->resv/groupspan(getmeta(fsptr)),1);
+		bmmark(fsptr,xn->resv,xn->resvlen,1);
+		grp->free+=xn->resvlen;
+		grp->reserved-=xn->resvlen;
+		groupunlock(grp);
+		xn->resvlen=0;
+		dirtyptr(fsptr,xn,sizeof(xinode));
+	}
+}
+//Drops the reservations of every node no one else has locked, the caller's own being left to it
+void resvall(void *fsptr)
+{
+	fsheader *fshead=fsptr;
+	pthread_rwlock_t *stripe;
+	size_t s, node;
+	
+	for(s=0;s<NODE_LOCKS;s++){
+		stripe=&getlocks(fsptr)->nodes[s];
+		if(pthread_rwlock_trywrlock(stripe)!=0) continue;
+		for(node=s;node<fshead->ntsize*NODES_BLOCK-1;node+=NODE_LOCKS) resvdrop(fsptr,(nodei)node);
+		pthread_rwlock_unlock(stripe);
+	}
+}
+int nodevalid(void *fsptr, nodei node)
+{
+	fsheader *fshead=(fsheader*)fsptr;
+	inode *nodetbl=O2P(fshead->nodetbl);
+	
+	if(node<0 || (size_t)node>=(fshead->ntsize*NODES_BLOCK-1)) return NODEI_BAD;
+	if(nodetbl[node].nlinks==0 ||(nodetbl[node].mode!=DIRMODE && nodetbl[node].mode!=FILEMODE)) return NODEI_GOOD;
+	return NODEI_LINKD;
+}
+
+pthread_rwlock_t *nodestripe(void *fsptr, nodei node)
+{
+	return &getlocks(fsptr)->nodes[node%NODE_LOCKS];
+}
+//Locks a node found by an earlier lookup, failing if it was unlinked or reused since; the generation is checked
+//first, as that is all a node's lock holder may read once it has been unlinked
+int nodelock(void *fsptr, nodei node, size_t gen, int write)
+{
+	pthread_rwlock_t *lock=nodestripe(fsptr,node);
+	
+	if(write) pthread_rwlock_wrlock(lock);
+	else pthread_rwlock_rdlock(lock);
+	if(xnodes(fsptr)[node].gen!=gen || nodevalid(fsptr,node)<NODEI_LINKD){
+		pthread_rwlock_unlock(lock);
+		return -1;
+	}if(write) nodedirty(fsptr,node);
+	return 0;
+}
+void nodeunlock(void *fsptr, nodei node)
+{
+	pthread_rwlock_unlock(nodestripe(fsptr,node));
+}
+//Sorted, distinct stripes of a set of nodes; holding several stripes means taking them in this order
+int stripes(nodei *nodes, int count, size_t *set)
+{
+	int n=0, i, j;
+	size_t s;
+	
+	for(i=0;i<count;i++){
+		s=nodes[i]%NODE_LOCKS;
+		for(j=0;j<n && set[j]<s;j++);
+		if(j<n && set[j]==s) continue;
+		memmove(&set[j+1],&set[j],(n-j)*sizeof(size_t));
+		set[j]=s;
+		n++;
+	}return n;
+}
+void nodesunlock(void *fsptr, nodei *nodes, int count)
+{
+	size_t set[4];
+	int n=stripes(nodes,count,set);
+	
+	while(n>0) pthread_rwlock_unlock(&getlocks(fsptr)->nodes[set[--n]]);
+}
+//Write locks up to four nodes at once, failing with none held if any of them changed since it was looked up
+int nodeslock(void *fsptr, nodei *nodes, size_t *gens, int count)
+{
+	size_t set[4];
+	int n=stripes(nodes,count,set), i;
+	
+	for(i=0;i<n;i++) pthread_rwlock_wrlock(&getlocks(fsptr)->nodes[set[i]]);
+	for(i=0;i<count;i++){
+		if(xnodes(fsptr)[nodes[i]].gen!=gens[i] || nodevalid(fsptr,nodes[i])<NODEI_LINKD){
+			nodesunlock(fsptr,nodes,count);
+			return -1;
+		}
+	}for(i=0;i<count;i++) nodedirty(fsptr,nodes[i]);
+	return 0;
+}
+
+void nodefree(void *fsptr, nodei node)
+{
+	agroup *grp=grouplock(fsptr,nodegroup(fsptr,node),1);
+	
+	xnodes(fsptr)[node].nextfree=grp->freenode;
+	nodedirty(fsptr,node);
+	grp->freenode=node;
+	grp->nodesfree++;
+	groupunlock(grp);
+}
+//Pushed from the top down so each group hands out its lowest free nodes first
+void nodelist(void *fsptr)
+{
+	fsheader *fshead=fsptr;
+	inode *nodetbl=O2P(fshead->nodetbl);
+	nodei node=fshead->ntsize*NODES_BLOCK-1;
+	
+	while(--node>0){
+		if(nodetbl[node].nlinks==0 && nodetbl[node].nblocks==0) nodefree(fsptr,node);
+	}
+}
+
+sz_blk extsearch(exthdr *hdr, sz_blk lblk)
+{
+	extent *ext=(extent*)(hdr+1);
+	sz_blk lo=0, hi=hdr->count;
+	
+	while(lo<hi){
+		sz_blk mid=(lo+hi)/2;
+		if(ext[mid].lblk<=lblk) lo=mid+1;
+		else hi=mid;
+	}return lo;
+}
+
+blkset extmap(void *fsptr, exthdr *hdr, sz_blk lblk, sz_blk next, sz_blk *run)
+{
+	extent *ext;
+	sz_blk dex;
+	
+	while(1){
+		ext=(extent*)(hdr+1);
+		dex=extsearch(hdr,lblk);
+		if(dex<hdr->count) next=ext[dex].lblk;
+		if(hdr->depth==0 || hdr->count==0) break;
+		hdr=B2P(ext[dex?dex-1:0].start);
+	}if(dex>0 && lblk<ext[dex-1].lblk+ext[dex-1].len){
+		*run=ext[dex-1].lblk+ext[dex-1].len-lblk;
+		return ext[dex-1].start+(lblk-ext[dex-1].lblk);
+	}*run=next-lblk;
+	return NULLOFF;
+}
+
+blkset bmap(void *fsptr, nodei node, sz_blk lblk, sz_blk *run)
+{
+	fsheader *fshead=fsptr;
+	inode *nodetbl=O2P(fshead->nodetbl);
+	
+	if(lblk>=nodetbl[node].nblocks){
+		*run=0;
+		return NULLOFF;
+	}return extmap(fsptr,&xnodes(fsptr)[node].map.hdr,lblk,nodetbl[node].nblocks,run);
+}
+
+void extgrow(void *fsptr, exthdr *root, blkset blk)
+{
+	exthdr *child=B2P(blk);
+	extent *ext=(extent*)(root+1);
+	
+	dirty(fsptr,blk,1);
+	memcpy(child,root,sizeof(exthdr)+root->count*sizeof(extent));
+	ext[0].start=blk;
+	ext[0].len=0;
+	root->count=1;
+	root->depth++;
+}
+
+int extinsert(void *fsptr, exthdr *root, sz_blk lblk, blkset start, sz_blk len)
+{
+	exthdr *path[EXT_MAXDEPTH+1], *hdr;
+	sz_blk pdex[EXT_MAXDEPTH+1], dex, cap, need=0;
+	blkset nblks[EXT_MAXDEPTH+1];
+	extent *ext, ins;
+	int lvl, d;
+	
+	path[0]=root;
+	for(d=0;path[d]->depth>0;d++){
+		dex=extsearch(path[d],lblk);
+		pdex[d]=dex?dex-1:0;
+		path[d+1]=B2P(((extent*)(path[d]+1))[pdex[d]].start);
+	}for(lvl=0;lvl<=d;lvl++) dirtyptr(fsptr,path[lvl],lvl?BLKSZ:sizeof(extroot));
+	hdr=path[d];
+	ext=(extent*)(hdr+1);
+	dex=extsearch(hdr,lblk);
+	
+	if(dex>0 && ext[dex-1].lblk+ext[dex-1].len==lblk && ext[dex-1].start+ext[dex-1].len==start){
+		ext[dex-1].len+=len;
+		if(dex<hdr->count && lblk+len==ext[dex].lblk && start+len==ext[dex].start){
+			ext[dex-1].len+=ext[dex].len;
+			memmove(&ext[dex],&ext[dex+1],(--hdr->count-dex)*sizeof(extent));
+		}return 0;
+	}if(dex<hdr->count && lblk+len==ext[dex].lblk && start+len==ext[dex].start){
+		ext[dex].lblk=lblk;
+		ext[dex].start=start;
+		ext[dex].len+=len;
+		for(lvl=d;lvl>0 && dex==0;lvl--){
+			dex=pdex[lvl-1];
+			((extent*)(path[lvl-1]+1))[dex].lblk=lblk;
+		}return 0;
+	}
+	
+	for(lvl=d;lvl>=0;lvl--){
+		cap=lvl?EXTS_BLOCK:EXTS_NODE;
+		if(path[lvl]->count<cap) break;
+		need++;
+	}if(lvl<0){
+		if(d==EXT_MAXDEPTH || blkalloc(fsptr,1,nblks)==0) return -1;
+		extgrow(fsptr,path[0],nblks[0]);
+		return extinsert(fsptr,root,lblk,start,len);
+	}if(need>0 && (cap=blkalloc(fsptr,need,nblks))<need){
+		blkfree(fsptr,cap,nblks);
+		return -1;
+	}
+	
+	ins.lblk=lblk; ins.start=start; ins.len=len;
+	for(lvl=d;;lvl--){
+		cap=lvl?EXTS_BLOCK:EXTS_NODE;
+		hdr=path[lvl];
+		ext=(extent*)(hdr+1);
+		if(hdr->count<cap){
+			memmove(&ext[dex+1],&ext[dex],(hdr->count-dex)*sizeof(extent));
+			ext[dex]=ins;
+			hdr->count++;
+			for(;lvl>0 && dex==0;lvl--){
+				dex=pdex[lvl-1];
+				((extent*)(path[lvl-1]+1))[dex].lblk=ins.lblk;
+			}return 0;
+		}else{
+			blkset sib=nblks[--need];
+			exthdr *shdr=B2P(sib);
+			extent *sext=(extent*)(shdr+1);
+			sz_blk half=(dex==hdr->count)?hdr->count:hdr->count/2;
+			
+			dirty(fsptr,sib,1);
+			shdr->depth=hdr->depth;
+			shdr->count=hdr->count-half;
+			memcpy(sext,&ext[half],shdr->count*sizeof(extent));
+			hdr->count=half;
+			if(dex>half || (dex==half && half==cap)){
+				dex-=half;
+				memmove(&sext[dex+1],&sext[dex],(shdr->count-dex)*sizeof(extent));
+				sext[dex]=ins;
+				shdr->count++;
+			}else{
+				memmove(&ext[dex+1],&ext[dex],(hdr->count-dex)*sizeof(extent));
+				ext[dex]=ins;
+				hdr->count++;
+				for(d=lvl;d>0 && dex==0;d--){
+					dex=pdex[d-1];
+					((extent*)(path[d-1]+1))[dex].lblk=ins.lblk;
+				}
+			}ins.lblk=sext[0].lblk;
+			ins.start=sib;
+			ins.len=0;
+			dex=pdex[lvl-1]+1;
+		}
+	}
+}
+
+void extdrop(void *fsptr, exthdr *hdr)
+{
+	extent *ext=(extent*)(hdr+1);
+	
+	dirtyptr(fsptr,hdr,sizeof(exthdr));
+	while(hdr->depth>0 && hdr->count>0){
+		blkset blk=ext[--hdr->count].start;
+		extdrop(fsptr,B2P(blk));
+		blkfree(fsptr,1,&blk);
+	}hdr->count=0;
+	hdr->depth=0;
+}
+
+//Unmaps everything at or past lblk, queueing the data and emptied extent blocks rather than freeing them one by one
+sz_blk extcut(void *fsptr, exthdr *hdr, sz_blk lblk, runbuf *batch)
+{
+	extent *ext=(extent*)(hdr+1);
+	sz_blk freed=0;
+	
+	dirtyptr(fsptr,hdr,sizeof(exthdr));
+	while(hdr->count>0){
+		extent *e=&ext[hdr->count-1];
+		if(hdr->depth==0){
+			if(e->lblk>=lblk){
+				runpush(fsptr,batch,e->start,e->len);
+				freed+=e->len;
+				hdr->count--;
+			}else{
+				if(e->lblk+e->len>lblk){
+					runpush(fsptr,batch,e->start+(lblk-e->lblk),e->lblk+e->len-lblk);
+					freed+=e->lblk+e->len-lblk;
+					e->len=lblk-e->lblk;
+				}break;
+			}
+		}else{
+			exthdr *child=B2P(e->start);
+			freed+=extcut(fsptr,child,lblk,batch);
+			if(child->count>0) break;
+			runpush(fsptr,batch,e->start,1);
+			hdr->count--;
+		}
+	}return freed;
+}
+
+//Mapped end of an extent tree, found down its rightmost path
+sz_blk extlast(void *fsptr, exthdr *hdr)
+{
+	extent *ext;
+	
+	while(hdr->count>0){
+		ext=(extent*)(hdr+1)+hdr->count-1;
+		if(hdr->depth==0) return ext->lblk+ext->len;
+		hdr=B2P(ext->start);
+	}return 0;
+}
+sz_blk extblocks(void *fsptr, exthdr *hdr)
+{
+	extent *ext=(extent*)(hdr+1);
+	sz_blk count=0, i;
+	
+	for(i=0;i<hdr->count;i++){
+		if(hdr->depth==0) count+=ext[i].len;
+		else count+=1+extblocks(fsptr,B2P(ext[i].start));
+	}return count;
+}
+
+//Frees the whole cut in one sorted pass over the bitmap, so a large file goes at the cost of its extent count;
+//returns every block freed, extent blocks included
+sz_blk exttrunc(void *fsptr, exthdr *root, sz_blk lblk)
+{
+	extent *ext=(extent*)(root+1);
+	runbuf batch={NULL,0,0};
+	
+	extcut(fsptr,root,lblk,&batch);
+	if(root->count==0) root->depth=0;
+	while(root->depth>0 && root->count==1){
+		blkset blk=ext[0].start;
+		exthdr *child=B2P(blk);
+		if(child->count>EXTS_NODE) break;
+		memcpy(root,child,sizeof(exthdr)+child->count*sizeof(extent));
+		runpush(fsptr,&batch,blk,1);
+	}return runflush(fsptr,&batch);
+}
+
+//Unlinked nodes are only detached: they wait on a list chained like the free one while their blocks are given back
+//a step at a time, and any handle still open on them goes stale at once. The caller holds the node's lock, and the
+//generation bumped here is what keeps every later locker off it while it is reclaimed
+void nodeorphan(void *fsptr, nodei node)
+{
+	fsheader *fshead=fsptr;
+	inode *nodetbl=O2P(fshead->nodetbl);
+	fsmeta *meta=getmeta(fsptr);
+	xinode *xn=&xnodes(fsptr)[node];
+	
+	xn->gen++;
+	resvdrop(fsptr,node);
+	if(nodetbl[node].nblocks==0 || xn->map.hdr.count==0){
+		memset(&xn->map,0,sizeof(extroot));
+		nodetbl[node].size=nodetbl[node].nblocks=0;
+		xn->valid=0;
+		nodefree(fsptr,node);
+		return;
+	}pthread_mutex_lock(&getlocks(fsptr)->orphans);
+	meta->pending+=extblocks(fsptr,&xn->map.hdr);
+	xn->nextfree=meta->orphans;
+	__atomic_store_n(&meta->orphans,node,__ATOMIC_RELAXED);
+	pthread_mutex_unlock(&getlocks(fsptr)->orphans);
+}
+//Frees about budget blocks off the ends of orphaned files, releasing each node once nothing is left under it
+sz_blk nodereap(void *fsptr, sz_blk budget)
+{
+	fsheader *fshead=fsptr;
+	inode *nodetbl=O2P(fshead->nodetbl);
+	fsmeta *meta=getmeta(fsptr);
+	sz_blk freed=0, cut;
+	
+	pthread_mutex_lock(&getlocks(fsptr)->orphans);
+	while(meta->orphans!=NONODE && freed<budget){
+		nodei node=meta->orphans;
+		xinode *xn=&xnodes(fsptr)[node];
+		nodedirty(fsptr,node);
+		cut=extlast(fsptr,&xn->map.hdr);
+		cut=(cut>budget-freed)?cut-(budget-freed):0;
+		freed+=exttrunc(fsptr,&xn->map.hdr,cut);
+		nodetbl[node].nblocks=cut;
+		nodetbl[node].size=MIN(nodetbl[node].size,cut*BLKSZ);
+		xn->valid=MIN(xn->valid,nodetbl[node].size);
+		if(cut>0) break;
+		__atomic_store_n(&meta->orphans,xn->nextfree,__ATOMIC_RELAXED);
+		nodefree(fsptr,node);
+	}meta->pending-=MIN(freed,meta->pending);
+	pthread_mutex_unlock(&getlocks(fsptr)->orphans);
+	return freed;
+}
+//Takes a node from the given group, or from the next one that has any left
+nodei newnode(void *fsptr, size_t first)
+{
+	fsmeta *meta=getmeta(fsptr);
+	nodei node=NONODE;
+	agroup *grp;
+	size_t i;
+	
+	for(i=0;i<livegroups(meta) && node==NONODE;i++){
+		grp=grouplock(fsptr,(first+i)%livegroups(meta),1);
+		if((node=grp->freenode)!=NONODE){
+			grp->freenode=xnodes(fsptr)[node].nextfree;
+			grp->nodesfree--;
+			nodedirty(fsptr,node);
+		}groupunlock(grp);
+	}if(node==NONODE && __atomic_load_n(&meta->orphans,__ATOMIC_RELAXED)!=NONODE){
+		nodereap(fsptr,~(sz_blk)0);
+		return newnode(fsptr,first);
+	}return node;
+}
+//New directories go to the group with the most free blocks, and the files made in them follow
+size_t dirgroup(void *fsptr)
+{
+	fsmeta *meta=getmeta(fsptr);
+	sz_blk most=0;
+	size_t i, group=0;
+	agroup *grp;
+	
+	for(i=0;i<livegroups(meta);i++){
+		grp=grouplock(fsptr,i,0);
+		if(grp->nodesfree>0 && grp->free>most){
+			most=grp->free;
+			group=i;
+		}groupunlock(grp);
+	}return group;
+}
+//Takes the free run at goal first so a growing file stays contiguous, then the largest runs from the goal's group
+//onwards; other files' reservations and the blocks of unlinked files are only given back once that is not enough
+sz_blk blkgoal(void *fsptr, blkset goal, sz_blk count, blkset *buf)
+{
+	fsheader *fshead=fsptr;
+	fsmeta *meta=getmeta(fsptr);
+	sz_blk alloct=0, run, reserved;
+	size_t first=threadgroup(fsptr), nodes;
+	agroup *grp;
+	
+	if(goal>=fshead->ntsize && goal<meta->metablk){
+		grp=grouplock(fsptr,first=goal/groupspan(meta),1);
+		if((run=bmrun(fsptr,goal,count))>0){
+			bmmark(fsptr,goal,run,0);
+			grp->free-=run;
+			for(;alloct<run;alloct++) buf[alloct]=goal+alloct;
+		}groupunlock(grp);
+	}alloct+=blkgroups(fsptr,first,count-alloct,buf+alloct);
+	if(alloct<count){
+		groupsum(fsptr,&run,&reserved,&nodes);
+		if(reserved==0 && __atomic_load_n(&meta->orphans,__ATOMIC_RELAXED)==NONODE) return alloct;
+		resvall(fsptr);
+		nodereap(fsptr,~(sz_blk)0);
+		alloct+=blkgroups(fsptr,first,count-alloct,buf+alloct);
+	}return alloct;
+}
+
+
+void posblk(void *fsptr, fpos *pos, sz_blk nblk)
+{
+	sz_blk adv=nblk-pos->nblk;
+	
+	if(nblk>=pos->nblk && adv<pos->opos){
+		if(pos->dblk!=NULLOFF) pos->dblk+=adv;
+		pos->opos-=adv;
+	}else{
+		pos->dblk=bmap(fsptr,pos->node,nblk,&(pos->opos));
+	}pos->nblk=nblk;
+}
+
+void loadpos(void *fsptr, fpos *pos, nodei node)
+{
+	fsheader *fshead=fsptr;
+	inode *nodetbl=O2P(fshead->nodetbl);
+	
+	if(pos==NULL) return;
+	if(nodevalid(fsptr,node)<NODEI_GOOD){
+		pos->node=NONODE;
+		return;
+	}pos->node=node;
+	pos->nblk=0;
+	pos->dpos=0;
+	pos->oblk=NULLOFF;
+	pos->dblk=bmap(fsptr,node,0,&(pos->opos));
+	pos->data=(nodetbl[node].size==0)?NULLOFF:pos->dblk*BLKSZ;
+}
+
+sz_blk advance(void *fsptr, fpos *pos, sz_blk blks)
+{
+	fsheader *fshead=fsptr;
+	inode *nodetbl=O2P(fshead->nodetbl);
+	sz_blk adv;
+	
+	if(pos==NULL || pos->node==NONODE || pos->nblk>=nodetbl[pos->node].nblocks) return 0;
+	adv=MIN(blks,nodetbl[pos->node].nblocks-1-pos->nblk);
+	statcount(fsptr,CT_ADVANCE,1);
+	statcount(fsptr,CT_ADVBLKS,adv);
+	posblk(fsptr,pos,pos->nblk+adv);
+	pos->dpos=0;
+	pos->data=pos->dblk*BLKSZ;
+	return adv;
+}
+
+size_t seek(void *fsptr, fpos *pos, size_t off)
+{
+	fsheader *fshead=fsptr;
+	inode *nodetbl=O2P(fshead->nodetbl);
+	size_t cur;
+	
+	if(pos==NULL || pos->node==NONODE) return 0;
+	cur=pos->nblk*BLKSZ+pos->dpos;
+	if(cur>=nodetbl[pos->node].size) return 0;
+	off=MIN(off,nodetbl[pos->node].size-cur);
+	
+	posblk(fsptr,pos,(cur+off)/BLKSZ);
+	pos->dpos=(cur+off)%BLKSZ;
+	if(cur+off==nodetbl[pos->node].size || pos->dblk==NULLOFF) pos->data=NULLOFF;
+	else pos->data=pos->dblk*BLKSZ+pos->dpos;
+	return off;
+}
+
+//Maps the holes under [off,off+size) to new blocks, clearing the parts of them the range does not cover.
+//New blocks go right after the block in front of the first hole, or to the node's group when there is none, and a
+//file growing at its end takes them from the run it reserved there last time, reserving about as much again as it
+//already has
+int blkfill(void *fsptr, nodei node, size_t off, size_t size)
+{
+	fsheader *fshead=fsptr;
+	inode *nodetbl=O2P(fshead->nodetbl);
+	fsmeta *meta=getmeta(fsptr);
+	xinode *xn=&xnodes(fsptr)[node];
+	exthdr *root=&xn->map.hdr;
+	sz_blk first=off/BLKSZ, last=CLDIV(off+size,BLKSZ), lblk, run, need=0, alloct=0, done, got, hole=0;
+	blkset *tblks, goal=NULLOFF;
+	agroup *grp;
+	
+	if(nodetbl[node].nblocks==0) return 0;
+	for(lblk=first;lblk<last;lblk+=run){
+		if(bmap(fsptr,node,lblk,&run)==NULLOFF){
+			if(need==0) hole=lblk;
+			need+=MIN(run,last-lblk);
+		}
+	}if(need==0) return 0;
+	if(hole>0 && (goal=bmap(fsptr,node,hole-1,&run))!=NULLOFF) goal++;
+	else if(hole==0) goal=groupgoal(fsptr,node);
+	if((tblks=(blkset*)malloc(need*sizeof(blkset)))==NULL) return -1;
+	if(goal!=NULLOFF && xn->resvlen>0 && xn->resv==goal){
+		grp=grouplock(fsptr,goal/groupspan(meta),1);
+		for(;alloct<need && alloct<xn->resvlen;alloct++) tblks[alloct]=goal+alloct;
+		grp->reserved-=alloct;
+		groupunlock(grp);
+		xn->resv+=alloct;
+		xn->resvlen-=alloct;
+		goal+=alloct;
+	}if((alloct+=blkgoal(fsptr,goal,need-alloct,tblks+alloct))<need && xn->resvlen>0){
+		resvdrop(fsptr,node);
+		alloct+=blkgoal(fsptr,goal,need-alloct,tblks+alloct);
+	}if(alloct<need){
+		blkfree(fsptr,alloct,tblks);
+		free(tblks);
+		return -1;
+	}if(last==nodetbl[node].nblocks && (hole==0 || goal!=NULLOFF) && xn->resvlen==0 && tblks[need-1]+1<meta->metablk){
+		run=(nodetbl[node].nblocks<PREALLOC_MIN)?PREALLOC_MIN:MIN(nodetbl[node].nblocks,PREALLOC_MAX);
+		grp=grouplock(fsptr,(tblks[need-1]+1)/groupspan(meta),1);
+		if((run=bmrun(fsptr,tblks[need-1]+1,run))>0){
+			xn->resv=tblks[need-1]+1;
+			xn->resvlen=run;
+			bmmark(fsptr,xn->resv,run,0);
+			grp->free-=run;
+			grp->reserved+=run;
+		}groupunlock(grp);
+	}
+	if(off%BLKSZ && bmap(fsptr,node,first,&run)==NULLOFF){
+		memset(B2P(tblks[0]),0,off%BLKSZ);
+	}if((off+size)%BLKSZ && bmap(fsptr,node,last-1,&run)==NULLOFF){
+		memset((char*)B2P(tblks[need-1])+(off+size)%BLKSZ,0,BLKSZ-(off+size)%BLKSZ);
+	}xn->mapver++;
+	
+	for(alloct=0,lblk=first;lblk<last;lblk+=run){
+		if(bmap(fsptr,node,lblk,&run)!=NULLOFF) continue;
+		for(run=MIN(run,last-lblk),done=0;done<run;done+=got){
+			for(got=1;done+got<run && tblks[alloct+got]==tblks[alloct]+got;got++);
+			if(extinsert(fsptr,root,lblk+done,tblks[alloct],got)==-1){
+				for(done=0;done<alloct;done++) memset(B2P(tblks[done]),0,BLKSZ);
+				blkfree(fsptr,need-alloct,&tblks[alloct]);
+				free(tblks);
+				return -1;
+			}alloct+=got;
+		}
+	}free(tblks);
+	return 0;
+}
+//Bytes past the valid mark were never written and read as zeros, as do holes, so blocks are not cleared when
+//allocated; a write starting past the mark clears only the gap in front of it, and a NULL buffer writes zeros
+size_t copyrun(void *fsptr, nodei node, char *buf, size_t size, size_t off, int write, fpos *cur)
+{
+	fsheader *fshead=fsptr;
+	inode *nodetbl=O2P(fshead->nodetbl);
+	xinode *xn=&xnodes(fsptr)[node];
+	fpos local, *pos=cur;
+	size_t copyct=0, dsize;
+	
+	if(off>=nodetbl[node].size) return 0;
+	size=MIN(size,nodetbl[node].size-off);
+	if(nodetbl[node].nblocks==0){
+		if(!write) memcpy(buf,(char*)&xn->map+off,size);
+		else if(buf!=NULL) memcpy((char*)&xn->map+off,buf,size);
+		else memset((char*)&xn->map+off,0,size);
+		return size;
+	}if(write && off>xn->valid) copyrun(fsptr,node,NULL,off-xn->valid,xn->valid,1,NULL);
+	dsize=size;
+	if(!write && off+size>xn->valid){
+		dsize=(off<xn->valid)?xn->valid-off:0;
+		memset(buf+dsize,0,size-dsize);
+	}if(pos==NULL){
+		pos=&local;
+		loadpos(fsptr,pos,node);
+		if(pos->node==NONODE) return 0;
+		seek(fsptr,pos,off);
+	}
+	
+	while(copyct<dsize){
+		size_t ct=MIN(pos->opos*BLKSZ-pos->dpos,dsize-copyct);
+		if(pos->dblk!=NULLOFF){
+			char *data=(char*)B2P(pos->dblk)+pos->dpos;
+			if(write) datadirty(fsptr,data,ct);
+			if(!write) memcpy(buf+copyct,data,ct);
+			else if(buf!=NULL) memcpy(data,buf+copyct,ct);
+			else memset(data,0,ct);
+		}else if(!write) memset(buf+copyct,0,ct);
+		else if(buf!=NULL) break;
+		copyct+=ct;
+		seek(fsptr,pos,ct);
+	}if(write && off+copyct>xn->valid) xn->valid=off+copyct;
+	return (copyct<dsize)?copyct:size;
+}
+//Points up to *count vectors straight at the data under [off,off+size), one per contiguous stretch of blocks, and
+//returns how much they cover, for writing into under the node's write lock. The blocks have to be there already
+size_t iovmap(void *fsptr, nodei node, struct iovec *iov, int *count, size_t size, size_t off)
+{
+	fsheader *fshead=fsptr;
+	inode *nodetbl=O2P(fshead->nodetbl);
+	xinode *xn=&xnodes(fsptr)[node];
+	fpos pos;
+	size_t mapct=0, ct;
+	int max=*count;
+	char *data;
+	
+	*count=0;
+	if(off>=nodetbl[node].size || max==0) return 0;
+	size=MIN(size,nodetbl[node].size-off);
+	if(nodetbl[node].nblocks==0){
+		iov[0].iov_base=(char*)&xn->map+off;
+		iov[0].iov_len=size;
+		*count=1;
+		return size;
+	}loadpos(fsptr,&pos,node);
+	if(pos.node==NONODE) return 0;
+	seek(fsptr,&pos,off);
+	
+	while(mapct<size && pos.dblk!=NULLOFF){
+		ct=MIN(pos.opos*BLKSZ-pos.dpos,size-mapct);
+		data=(char*)B2P(pos.dblk)+pos.dpos;
+		datadirty(fsptr,data,ct);
+		if(*count>0 && (char*)iov[*count-1].iov_base+iov[*count-1].iov_len==data){
+			iov[*count-1].iov_len+=ct;
+		}else if(*count<max){
+			iov[*count].iov_base=data;
+			iov[(*count)++].iov_len=ct;
+		}else break;
+		mapct+=ct;
+		seek(fsptr,&pos,ct);
+	}return mapct;
+}
+//Growing a file only moves its size; the new range is a hole until something is written there.
+//Files of at most INLINE_MAX bytes keep them in the extent root instead, marked by a size with no blocks, and are
+//moved out to a block when they grow past that. The root is the one every node has for its extents, so an inline
+//file costs no more than an empty one
+int fresize(void *fsptr, nodei node, size_t size)
+{
+	fsheader *fshead=fsptr;
+	inode *nodetbl=O2P(fshead->nodetbl);
+	xinode *xn;
+	extroot data;
+	size_t oldsize;
+	sz_blk blksize;
+	
+	if(nodevalid(fsptr,node)<NODEI_GOOD || nodetbl[node].mode==DIRMODE) return -1;
+	xn=&xnodes(fsptr)[node];
+	oldsize=nodetbl[node].size;
+	if(nodetbl[node].nblocks==0 && size<=INLINE_MAX){
+		if(size>oldsize) memset((char*)&xn->map+oldsize,0,size-oldsize);
+		else if(size==0) memset(&xn->map,0,sizeof(extroot));
+		nodetbl[node].size=size;
+		xn->mapver++;
+		return 0;
+	}if(nodetbl[node].nblocks==0 && oldsize>0){
+		data=xn->map;
+		memset(&xn->map,0,sizeof(extroot));
+		nodetbl[node].nblocks=CLDIV(oldsize,BLKSZ);
+		xn->valid=0;
+		if(blkfill(fsptr,node,0,oldsize)==-1){
+			xn->map=data;
+			nodetbl[node].nblocks=0;
+			return -1;
+		}copyrun(fsptr,node,(char*)&data,oldsize,0,1,NULL);
+	}blksize=CLDIV(size,BLKSZ);
+	if(blksize<nodetbl[node].nblocks){
+		exttrunc(fsptr,&xnodes(fsptr)[node].map.hdr,blksize);
+		resvdrop(fsptr,node);
+	}
+	nodetbl[node].nblocks=blksize;
+	nodetbl[node].size=size;
+	xnodes(fsptr)[node].valid=MIN(xnodes(fsptr)[node].valid,size);
+	xnodes(fsptr)[node].mapver++;
+	return 0;
+}
+//Timed like an operation but never traced, so it is numbered after the last op of the trace format
+int frealloc(void *fsptr, nodei node, size_t size)
+{
+	uint64_t start=opstart();
+	int ret=fresize(fsptr,node,size);
+	
+	opdone(fsptr,getmeta(fsptr),OP_FREALLOC,start,ret<0);
+	return ret;
+}
+
+//Handles are copied out and back under their slot's stripe of the table locks, as calls on one handle can run side by
+//side; whether the node behind it is still the one opened is only known once its lock is held
+pthread_mutex_t *ofstripe(void *fsptr, size_t slot)
+{
+	return &getlocks(fsptr)->ofiles[slot%OFILE_LOCKS];
+}
+int ofget(void *fsptr, uint64_t fh, ofile *of)
+{
+	fsmeta *meta=getmeta(fsptr);
+	
+	if(fh==0 || fh>FILES_OPEN) return -1;
+	pthread_mutex_lock(ofstripe(fsptr,fh-1));
+	*of=((ofile*)O2P(meta->ofiles))[fh-1];
+	pthread_mutex_unlock(ofstripe(fsptr,fh-1));
+	return (of->node>0)?0:-1;
+}
+void ofput(void *fsptr, uint64_t fh, ofile *of)
+{
+	ofile *slot=&((ofile*)O2P(getmeta(fsptr)->ofiles))[fh-1];
+	
+	pthread_mutex_lock(ofstripe(fsptr,fh-1));
+	if(slot->node==of->node && slot->gen==of->gen) *slot=*of;
+	pthread_mutex_unlock(ofstripe(fsptr,fh-1));
+}
+//The search starts after the slot last handed out, a hint only, and claims the first free slot under its own stripe
+uint64_t ofopen(void *fsptr, nodei node)
+{
+	fsmeta *meta=getmeta(fsptr);
+	ofile *ofiles=O2P(meta->ofiles);
+	size_t i, slot, next=__atomic_load_n(&meta->ofnext,__ATOMIC_RELAXED);
+	uint64_t fh=0;
+	
+	for(i=0;i<FILES_OPEN && fh==0;i++){
+		slot=(next+i)%FILES_OPEN;
+		pthread_mutex_lock(ofstripe(fsptr,slot));
+		if(ofiles[slot].node==0){
+			ofiles[slot].node=node;
+			ofiles[slot].gen=xnodes(fsptr)[node].gen;
+			ofiles[slot].mapver=xnodes(fsptr)[node].mapver-1;
+			fh=slot+1;
+		}pthread_mutex_unlock(ofstripe(fsptr,slot));
+	}if(fh!=0) __atomic_store_n(&meta->ofnext,fh,__ATOMIC_RELAXED);
+	return fh;
+}
+void ofclose(void *fsptr, uint64_t fh)
+{
+	if(fh==0 || fh>FILES_OPEN) return;
+	pthread_mutex_lock(ofstripe(fsptr,fh-1));
+	((ofile*)O2P(getmeta(fsptr)->ofiles))[fh-1].node=0;
+	pthread_mutex_unlock(ofstripe(fsptr,fh-1));
+}
+//Reuses the cursor when the call picks up where the last one stopped and nothing has remapped the file since
+void ofseek(void *fsptr, ofile *of, size_t off)
+{
+	xinode *xn=&xnodes(fsptr)[of->node];
+	
+	if(of->mapver!=xn->mapver || of->pos.nblk*BLKSZ+of->pos.dpos!=off){
+		loadpos(fsptr,&of->pos,of->node);
+		seek(fsptr,&of->pos,off);
+		of->mapver=xn->mapver;
+	}
+}
+
+uint32_t dchash(nodei parent, const char *name, size_t len)
+{
+	uint32_t hash=2166136261u;
+	size_t i;
+	
+	for(i=0;i<len;i++) hash=(hash^(unsigned char)name[i])*16777619u;
+	return hash^((uint32_t)parent*2654435761u);
+}
+
+dentry *dcslot(void *fsptr, uint32_t hash)
+{
+	fsmeta *meta=getmeta(fsptr);
+	return &((dentry*)O2P(meta->dcache))[hash&(meta->dcsize-1)];
+}
+//Each slot is guarded by one stripe of the cache locks, so lookups of different names rarely meet; the hit and miss
+//counts are shared, and only ever added to atomically
+pthread_mutex_t *dcstripe(void *fsptr, dentry *de)
+{
+	return &getlocks(fsptr)->dcache[(de-(dentry*)O2P(getmeta(fsptr)->dcache))%DCACHE_LOCKS];
+}
+
+//Entries carry the generation their node had when it was found, for the caller to lock it against
+nodei dcget(void *fsptr, nodei parent, const char *name, size_t len, size_t *gen)
+{
+	fsmeta *meta=getmeta(fsptr);
+	uint32_t hash=dchash(parent,name,len);
+	dentry *de=dcslot(fsptr,hash);
+	nodei node=NONODE;
+	
+	pthread_mutex_lock(dcstripe(fsptr,de));
+	if(de->gen!=0 && (parent!=NONODE || de->gen==__atomic_load_n(&meta->dgen,__ATOMIC_ACQUIRE)) && de->hash==hash
+		&& de->len==len && de->parent==parent && memcmp(de->name,name,len)==0){
+		node=de->node;
+		*gen=de->nodegen;
+	}pthread_mutex_unlock(dcstripe(fsptr,de));
+	__atomic_fetch_add((node!=NONODE)?&meta->dhits:&meta->dmisses,1,__ATOMIC_RELAXED);
+	return node;
+}
+
+//Full paths are put with the cache generation read before the lookup began, so one that raced a rename never hits
+void dcput(void *fsptr, nodei parent, const char *name, size_t len, nodei node, size_t gen, size_t dgen)
+{
+	uint32_t hash=dchash(parent,name,len);
+	dentry *de=dcslot(fsptr,hash);
+	
+	if(len==0 || len>=DCACHE_NAMELEN) return;
+	pthread_mutex_lock(dcstripe(fsptr,de));
+	de->hash=hash;
+	de->len=len;
+	de->parent=parent;
+	de->node=node;
+	de->gen=dgen;
+	de->nodegen=gen;
+	memcpy(de->name,name,len);
+	pthread_mutex_unlock(dcstripe(fsptr,de));
+}
+
+//Full paths can run through the changed entry, so they all go stale at once.
+void dcdrop(void *fsptr, nodei parent, const char *name)
+{
+	fsmeta *meta=getmeta(fsptr);
+	size_t len=0, dgen;
+	dentry *de;
+	
+	while(name[len]!='/' && name[len]!='\0') len++;
+	de=dcslot(fsptr,dchash(parent,name,len));
+	pthread_mutex_lock(dcstripe(fsptr,de));
+	if(de->parent==parent && de->len==len && memcmp(de->name,name,len)==0) de->gen=0;
+	pthread_mutex_unlock(dcstripe(fsptr,de));
+	dgen=__atomic_load_n(&meta->dgen,__ATOMIC_RELAXED);
+	while(!__atomic_compare_exchange_n(&meta->dgen,&dgen,(dgen+1==0)?1:dgen+1,0,__ATOMIC_RELEASE,__ATOMIC_RELAXED));
+}
+
+size_t complen(const char *path)
+{
+	size_t len=0;
+	while(path[len]!='/' && path[len]!='\0' && len<NAMELEN-1) len++;
+	return len;
+}
+
+dirblk *dirblkp(void *fsptr, nodei dir, sz_blk lblk)
+{
+	sz_blk run;
+	return B2P(bmap(fsptr,dir,lblk,&run));
+}
+
+dirrec *dirnext(dirrec *rec)
+{
+	return (dirrec*)((char*)rec+rec->len);
+}
+
+//Records are packed from the front of the block, so a scan stops at the used mark rather than the block end
+dirrec *dirscan(dirblk *blk, const char *name)
+{
+	char *end=(char*)blk+blk->used;
+	size_t len=complen(name);
+	dirrec *rec;
+	
+	for(rec=(dirrec*)(blk+1);(char*)rec<end && rec->len>0;rec=dirnext(rec)){
+		if(rec->namelen==len && memcmp(rec->name,name,len)==0) return rec;
+	}return NULL;
+}
+
+uint32_t namehash(const char *path)
+{
+	uint32_t hash=2166136261u;
+	size_t len=0;
+	
+	while(path[len]!='/' && path[len]!='\0' && len<NAMELEN-1){
+		hash=(hash^(unsigned char)path[len++])*16777619u;
+	}return hash;
+}
+
+dirslot *slotp(void *fsptr, exthdr *hmap, size_t i)
+{
+	sz_blk run;
+	dirslot *slots=B2P(extmap(fsptr,hmap,i/SLOTS_BLOCK,i/SLOTS_BLOCK+1,&run));
+	return &slots[i%SLOTS_BLOCK];
+}
+
+void hashput(void *fsptr, exthdr *hmap, size_t hsize, uint32_t hash, size_t entry)
+{
+	size_t i=hash&(hsize-1);
+	dirslot *slot;
+	
+	while((slot=slotp(fsptr,hmap,i))->entry!=0) i=(i+1)&(hsize-1);
+	dirtyptr(fsptr,slot,sizeof(dirslot));
+	slot->hash=hash;
+	slot->entry=entry+1;
+}
+
+size_t hashslot(void *fsptr, exthdr *hmap, size_t hsize, uint32_t hash, size_t entry)
+{
+	size_t i=hash&(hsize-1);
+	dirslot *slot;
+	
+	while((slot=slotp(fsptr,hmap,i))->entry!=entry+1 || slot->hash!=hash) i=(i+1)&(hsize-1);
+	return i;
+}
+
+void hashdel(void *fsptr, exthdr *hmap, size_t hsize, uint32_t hash, size_t entry)
+{
+	size_t i=hashslot(fsptr,hmap,hsize,hash,entry), j=i, home;
+	dirslot *slot=slotp(fsptr,hmap,i), *next;
+	
+	while(1){
+		j=(j+1)&(hsize-1);
+		if((next=slotp(fsptr,hmap,j))->entry==0) break;
+		home=next->hash&(hsize-1);
+		if((i<j)?(home<=i || home>j):(home<=i && home>j)){
+			dirtyptr(fsptr,slot,sizeof(dirslot));
+			*slot=*next;
+			slot=next;
+			i=j;
+		}
+	}dirtyptr(fsptr,slot,sizeof(dirslot));
+	slot->hash=0;
+	slot->entry=0;
+}
+
+void hashdrop(void *fsptr, xinode *xn)
+{
+	exttrunc(fsptr,&(xn->hmap.hdr),0);
+	xn->hsize=0;
+}
+
+int hashgrow(void *fsptr, nodei dir, size_t hsize)
+{
+	fsheader *fshead=fsptr;
+	inode *nodetbl=O2P(fshead->nodetbl);
+	xinode *xn=&xnodes(fsptr)[dir];
+	extroot hmap;
+	blkset *tblks;
+	sz_blk nblk=hsize/SLOTS_BLOCK, alloct, run;
+	size_t i;
+	
+	memset(&hmap,0,sizeof(extroot));
+	if((tblks=(blkset*)malloc(nblk*sizeof(blkset)))==NULL) return -1;
+	if((alloct=blkalloc(fsptr,nblk,tblks))<nblk){
+		blkfree(fsptr,alloct,tblks);
+		free(tblks);
+		return -1;
+	}for(alloct=0;alloct<nblk;alloct+=run){
+		for(run=1;alloct+run<nblk && tblks[alloct+run]==tblks[alloct]+run;run++);
+		memset(B2P(tblks[alloct]),0,run*BLKSZ);
+		dirty(fsptr,tblks[alloct],run);
+		if(extinsert(fsptr,&hmap.hdr,alloct,tblks[alloct],run)==-1){
+			exttrunc(fsptr,&hmap.hdr,0);
+			blkfree(fsptr,nblk-alloct,&tblks[alloct]);
+			free(tblks);
+			return -1;
+		}
+	}free(tblks);
+	
+	if(xn->hsize>0){
+		for(i=0;i<xn->hsize;i++){
+			dirslot *slot=slotp(fsptr,&(xn->hmap.hdr),i);
+			if(slot->entry!=0) hashput(fsptr,&hmap.hdr,hsize,slot->hash,slot->entry-1);
+		}
+	}else{
+		for(i=0;i<nodetbl[dir].nblocks;i++){
+			dirblk *blk=dirblkp(fsptr,dir,i);
+			dirrec *rec;
+			for(rec=(dirrec*)(blk+1);(char*)rec<(char*)blk+blk->used && rec->len>0;rec=dirnext(rec)){
+				hashput(fsptr,&hmap.hdr,hsize,namehash(rec->name),i);
+			}
+		}
+	}hashdrop(fsptr,xn);
+	xn->hmap=hmap;
+	xn->hsize=hsize;
+	return 0;
+}
 
-sz_blk blkalloc(void *fsptr, sz_blk count, blkset *buf)
+size_t hashsize(size_t count)
 {
-	fsheader *fshead=fsptr;
-	blkset freeoff=fshead->freelist;
-	freereg *prev=NULL;
-	sz_blk alloct=0;
-	
-	while(alloct<count && freeoff!=NULLOFF){
-		freereg fhead=*(freereg*)B2P(freeoff);
-		sz_blk freeblk=0;
-		while(freeblk<(fhead.size) && alloct<count){
-			buf[alloct++]=freeoff+freeblk++;
-		}memset(B2P(freeoff),0,freeblk*BLKSZ);
-		if(freeblk==(fhead.size)){
-			freeoff=fhead.next;
-			if(prev!=NULL) prev->next=fhead.next;
-			else fshead->freelist=fhead.next;
-		}else{
-			fhead.size-=freeblk;
-			freeoff+=freeblk;
-			if(prev!=NULL) prev->next=freeoff;
-			else fshead->freelist=freeoff;
-			prev=(freereg*)B2P(freeoff);
-			*prev=fhead;
-		}
-	}fshead->free-=alloct;
-	return alloct;
+	size_t hsize=SLOTS_BLOCK;
+	while(hsize<2*count) hsize*=2;
+	return hsize;
 }
 
-void swap(blkset *A, blkset *B){ blkset t=*A; *A=*B; *B=t; }
-void filter(blkset *heap, size_t dex, size_t len)
+//Index slots name the block holding an entry, which is then scanned
+dirrec *dirfind(void *fsptr, nodei dir, const char *name, sz_blk *lblk)
 {
-	size_t ch0=2*dex+1,ch1=2*(dex+1);
+	fsheader *fshead=fsptr;
+	inode *nodetbl=O2P(fshead->nodetbl);
+	xinode *xn=&xnodes(fsptr)[dir];
+	dirrec *rec=NULL;
 	
-	if(ch0<len){
-		if(heap[ch0]>heap[dex] && (ch1>=len || heap[ch0]>=heap[ch1])){
-			swap(&heap[dex],&heap[ch0]);
-			filter(heap,ch0,len);
-		}else if(ch1<len && heap[ch1]>heap[dex]){
-			swap(&heap[dex],&heap[ch1]);
-			filter(heap,ch1,len);
-		}
+	if(xn->hsize>0){
+		uint32_t hash=namehash(name);
+		size_t i=hash&(xn->hsize-1);
+		dirslot *slot;
+		while((slot=slotp(fsptr,&(xn->hmap.hdr),i))->entry!=0){
+			if(slot->hash==hash){
+				statcount(fsptr,CT_DIRSCAN,1);
+				if((rec=dirscan(dirblkp(fsptr,dir,slot->entry-1),name))!=NULL){
+					*lblk=slot->entry-1;
+					return rec;
+				}
+			}i=(i+1)&(xn->hsize-1);
+		}return NULL;
 	}
+	
+	for(*lblk=0;*lblk<nodetbl[dir].nblocks;(*lblk)++){
+		if((rec=dirscan(dirblkp(fsptr,dir,*lblk),name))!=NULL) break;
+	}statcount(fsptr,CT_DIRSCAN,MIN(*lblk+1,nodetbl[dir].nblocks));
+	return rec;
 }
-void offsort(blkset *data,size_t len)
+
+//Appends to the last block when the record fits there, otherwise to a new block placed after it
+int dirput(void *fsptr, nodei dir, const char *name, nodei node)
 {
-	size_t i=len;
+	fsheader *fshead=fsptr;
+	inode *nodetbl=O2P(fshead->nodetbl);
+	xinode *xn=&xnodes(fsptr)[dir];
+	size_t len=complen(name), reclen=DIRREC_LEN(len);
+	dirblk *blk=NULL;
+	dirrec *rec;
+	sz_blk lblk=nodetbl[dir].nblocks-1, run;
 	
-	while(i) filter(data,--i,len);
-	while(len){
-		swap(data,&data[--len]);
-		filter(data,0,len);
+	if(nodetbl[dir].nblocks>0){
+		blk=dirblkp(fsptr,dir,lblk);
+		if(blk->used+reclen>BLKSZ) blk=NULL;
+	}if(blk==NULL){
+		blkset dblk, goal=NULLOFF;
+		if(nodetbl[dir].nblocks==0) goal=groupgoal(fsptr,dir);
+		else if((goal=bmap(fsptr,dir,lblk,&run))!=NULLOFF) goal++;
+		if(blkgoal(fsptr,goal,1,&dblk)==0) return -1;
+		if(extinsert(fsptr,&(xn->map.hdr),nodetbl[dir].nblocks,dblk,1)==-1){
+			blkfree(fsptr,1,&dblk);
+			return -1;
+		}lblk=nodetbl[dir].nblocks++;
+		blk=B2P(dblk);
+		blk->used=sizeof(dirblk);
+		blk->count=0;
 	}
+	
+	dirtyptr(fsptr,blk,BLKSZ);
+	rec=(dirrec*)((char*)blk+blk->used);
+	rec->node=node;
+	rec->len=reclen;
+	rec->namelen=len;
+	memcpy(rec->name,name,len);
+	memset(rec->name+len,0,reclen-offsetof(dirrec,name)-len);
+	blk->used+=reclen;
+	blk->count++;
+	nodetbl[dir].size++;
+	if(xn->hsize>0) hashput(fsptr,&(xn->hmap.hdr),xn->hsize,namehash(rec->name),lblk);
+	return 0;
 }
-sz_blk blkfree(void *fsptr, sz_blk count, blkset *buf)
+
+//Closes the gap inside the block, then refills it from the end of the directory so that only the last block
+//is ever short by more than a record, and frees the last block once it empties
+void dirdel(void *fsptr, nodei dir, sz_blk lblk, dirrec *rec)
 {
 	fsheader *fshead=fsptr;
-	blkset freeoff=fshead->freelist;
-	freereg *fhead;
-	sz_blk freect=0;
+	inode *nodetbl=O2P(fshead->nodetbl);
+	xinode *xn=&xnodes(fsptr)[dir];
+	sz_blk last=nodetbl[dir].nblocks-1;
+	dirblk *blk=dirblkp(fsptr,dir,lblk), *tail=dirblkp(fsptr,dir,last);
+	dirrec *mv;
+	size_t reclen=rec->len;
 	
-	offsort(buf,count);
-	while(freect<count && *buf<(fshead->ntsize)){
-		*(buf++)=NULLOFF; count--;
-	}if(freect<count && ((freeoff==NULLOFF && *buf<fshead->size) || *buf<freeoff)){
-		fhead=(freereg*)B2P(freeoff=*buf);
-		fhead->next=fshead->freelist;
-		fshead->freelist=freeoff;
-		if((freeoff+(fhead->size=1))==fhead->next){
-			freereg *tmp=B2P(fhead->next);
-			fhead->size+=tmp->size;
-			fhead->next=tmp->next;
-		}buf[freect++]=NULLOFF;
-	}while(freect<count && buf[freect]<fshead->size){
-		fhead=(freereg*)B2P(freeoff);
-		if(buf[freect]>=(freeoff+fhead->size)){
-			if(fhead->next!=NULLOFF && buf[freect]>=fhead->next){
-				freeoff=fhead->next;
-				continue;
-			}if(buf[freect]==(freeoff+fhead->size)){
-				fhead->size++;
-			}else{
-				freereg *tmp=B2P(freeoff=buf[freect]);
-				tmp->next=fhead->next;
-				tmp->size=1;
-				fhead->next=freeoff;
-				fhead=tmp;
-			}if((freeoff+fhead->size)==fhead->next){
-				freereg *tmp=B2P(fhead->next);
-				fhead->size+=tmp->size;
-				fhead->next=tmp->next;
-			}buf[freect++]=NULLOFF;
-		}else{
-			(buf++)[freect]=NULLOFF; count--;
+	dirtyptr(fsptr,blk,BLKSZ);
+	dirtyptr(fsptr,tail,BLKSZ);
+	if(xn->hsize>0) hashdel(fsptr,&(xn->hmap.hdr),xn->hsize,namehash(rec->name),lblk);
+	memmove(rec,dirnext(rec),(char*)blk+blk->used-(char*)dirnext(rec));
+	blk->used-=reclen;
+	blk->count--;
+	nodetbl[dir].size--;
+	
+	while(lblk!=last && tail->count>0){
+		for(mv=(dirrec*)(tail+1);(char*)dirnext(mv)<(char*)tail+tail->used;mv=dirnext(mv));
+		if(blk->used+mv->len>BLKSZ) break;
+		memcpy((char*)blk+blk->used,mv,mv->len);
+		blk->used+=mv->len;
+		blk->count++;
+		tail->used-=mv->len;
+		tail->count--;
+		if(xn->hsize>0){
+			uint32_t hash=namehash(mv->name);
+			dirslot *slot=slotp(fsptr,&(xn->hmap.hdr),hashslot(fsptr,&(xn->hmap.hdr),xn->hsize,hash,last));
+			dirtyptr(fsptr,slot,sizeof(dirslot));
+			slot->entry=lblk+1;
 		}
-	}while(freect<count){
-		(buf++)[freect]=NULLOFF; count--;
-	}fshead->free+=freect;
-	return freect;
+	}if(tail->count==0){
+		exttrunc(fsptr,&(xn->map.hdr),last);
+		nodetbl[dir].nblocks--;
+	}if(nodetbl[dir].size==0 && xn->hsize>0) hashdrop(fsptr,xn);
 }
 
-nodei newnode(void *fsptr)
+nodei dirmod(void *fsptr, nodei dir, const char *name, nodei node, const char *rename)
 {
 	fsheader *fshead=fsptr;
 	inode *nodetbl=O2P(fshead->nodetbl);
-	size_t nodect=fshead->ntsize*NODES_BLOCK-1;
-	nodei i=0;
-	while(++i<nodect){
-		if(nodetbl[i].nlinks==0 && nodetbl[i].blocks[0]==NULLOFF) return i;
-	}return NONODE;
+	xinode *xn;
+	dirrec *df=NULL;
+	sz_blk lblk, nblk;
+	
+	statcount(fsptr,CT_DIRMOD,1);
+	if(nodevalid(fsptr,dir)<NODEI_LINKD || nodetbl[dir].mode!=DIRMODE) return NONODE;
+	if(node!=NONODE && rename==NULL && nodevalid(fsptr,node)<NODEI_GOOD) return NONODE;
+	if(*name=='\0' || (rename!=NULL && node==NONODE && *rename=='\0')) return NONODE;
+	
+	//lookups only hold the directory shared, so a missing index waits for the next change to it
+	xn=&xnodes(fsptr)[dir];
+	if(xn->hsize==0 && nodetbl[dir].size>DIRHASH_MIN && (node!=NONODE || rename!=NULL)){
+		hashgrow(fsptr,dir,hashsize(nodetbl[dir].size));
+	}if((df=dirfind(fsptr,dir,name,&lblk))!=NULL){
+		if(rename==NULL){
+			if(node==NONODE) return df->node;
+			return NONODE;
+		}
+	}else if(rename!=NULL || node==NONODE) return NONODE;
+	
+	if(node==NONODE){
+		if(dirfind(fsptr,dir,rename,&nblk)!=NULL) return NONODE;
+		node=df->node;
+		dcdrop(fsptr,dir,name);
+		if(DIRREC_LEN(complen(rename))>df->len){
+			if(dirput(fsptr,dir,rename,node)==-1) return NONODE;
+			dirdel(fsptr,dir,lblk,df);
+			return node;
+		}if(xn->hsize>0) hashdel(fsptr,&(xn->hmap.hdr),xn->hsize,namehash(df->name),lblk);
+		dirtyptr(fsptr,df,df->len);
+		df->namelen=complen(rename);
+		memcpy(df->name,rename,df->namelen);
+		df->name[df->namelen]='\0';
+		if(xn->hsize>0) hashput(fsptr,&(xn->hmap.hdr),xn->hsize,namehash(df->name),lblk);
+		return node;
+	}if(rename!=NULL){
+		node=df->node;
+		if(nodetbl[node].mode==DIRMODE && nodetbl[node].nlinks==1 && nodetbl[node].size>0) return NONODE;
+		dcdrop(fsptr,dir,name);
+		dirdel(fsptr,dir,lblk,df);
+		//update dir node times?
+		nodetbl[node].nlinks--;
+		return node;
+	}
+	
+	if(nodetbl[dir].size+1>DIRHASH_MIN && 2*(nodetbl[dir].size+1)>xn->hsize){
+		if(hashgrow(fsptr,dir,hashsize(nodetbl[dir].size+1))==-1 && xn->hsize>0 && nodetbl[dir].size+1>=xn->hsize){
+			hashdrop(fsptr,xn);
+		}
+	}if(dirput(fsptr,dir,name,node)==-1) return NONODE;
+	nodetbl[node].nlinks++;
+	return node;
 }
 
-int nodevalid(void *fsptr, nodei node)
+//Each directory on the way is held shared while it is searched, and the generation of the node found is read
+//under it; the caller locks the result with that generation, since it can be unlinked as soon as it is returned
+nodei path2node(void *fsptr, const char *path, const char **child, size_t *gen)
 {
-	fsheader *fshead=(fsheader*)fsptr;
-	inode *nodetbl=O2P(fshead->nodetbl);
+	nodei node=0, next;
+	size_t sub=1, ch=1, len, dgen, ngen;
 	
-	if(node<0 || node>=(fshead->ntsize*NODES_BLOCK-1)) return NODEI_BAD;
-	if(nodetbl[node].nlinks==0 ||(nodetbl[node].mode!=DIRMODE && nodetbl[node].mode!=FILEMODE)) return NODEI_GOOD;
-	return NODEI_LINKD;
+	if(path[0]!='/') return NONODE;
+	
+	statcount(fsptr,CT_PATH2NODE,1);
+	len=strlen(path);
+	if(child!=NULL){
+		while(path[sub=ch]!='\0'){
+			while(path[ch]!='\0'){
+				if(path[ch++]=='/') break;
+			}if(path[ch]=='\0') break;
+		}*child=&path[sub];
+		len=sub-1;
+		sub=1;
+	}*gen=xnodes(fsptr)[0].gen;
+	if(len<=1) return 0;
+	
+	dgen=__atomic_load_n(&getmeta(fsptr)->dgen,__ATOMIC_ACQUIRE);
+	if((node=dcget(fsptr,NONODE,path,len,gen))!=NONODE) return node;
+	for(node=0;sub<len;sub=ch+1){
+		for(ch=sub;ch<len && path[ch]!='/';ch++);
+		statcount(fsptr,CT_PATHWALK,1);
+		if(nodelock(fsptr,node,*gen,0)==-1) return NONODE;
+		if((next=dcget(fsptr,node,&path[sub],ch-sub,&ngen))==NONODE
+			&& (next=dirmod(fsptr,node,&path[sub],NONODE,NULL))!=NONODE){
+			ngen=xnodes(fsptr)[next].gen;
+			dcput(fsptr,node,&path[sub],ch-sub,next,ngen,dgen);
+		}nodeunlock(fsptr,node);
+		if(next==NONODE) return NONODE;
+		node=next;
+		*gen=ngen;
+	}dcput(fsptr,NONODE,path,len,node,*gen,dgen);
+	return node;
 }
 
-void loadpos(void *fsptr, fpos *pos, nodei node)
+//Looks a path up and locks what it names, shared or exclusive; NONODE if it is gone by the time it is locked
+nodei pathlock(void *fsptr, const char *path, int write)
+{
+	nodei node;
+	size_t gen;
+	
+	if((node=path2node(fsptr,path,NULL,&gen))==NONODE || nodelock(fsptr,node,gen,write)==-1) return NONODE;
+	return node;
+}
+//Locks the node behind an open handle, or the one at the path once the handle has gone stale, clearing *fh then
+//so that the cursor is neither used nor put back
+nodei fhlock(void *fsptr, const char *path, uint64_t *fh, ofile *of, int write)
+{
+	if(ofget(fsptr,*fh,of)==0 && nodelock(fsptr,of->node,of->gen,write)==0) return of->node;
+	*fh=0;
+	return pathlock(fsptr,path,write);
+}
+//Write locks a path's directory and the entry in it together, as nodes[0] and nodes[1], checking that the name
+//still leads to the entry once both are held. Returns the entry, or NONODE with nothing held
+nodei entrylock(void *fsptr, const char *path, nodei *nodes, const char **name)
+{
+	size_t gens[2];
+	
+	if((nodes[0]=path2node(fsptr,path,name,&gens[0]))==NONODE) return NONODE;
+	if((nodes[1]=path2node(fsptr,path,NULL,&gens[1]))==NONODE) return NONODE;
+	if(nodeslock(fsptr,nodes,gens,2)==-1) return NONODE;
+	if(dirmod(fsptr,nodes[0],*name,NONODE,NULL)!=nodes[1]){
+		nodesunlock(fsptr,nodes,2);
+		return NONODE;
+	}return nodes[1];
+}
+//Reads hold their node shared, so the access time is stored a field at a time for concurrent ones not to tear it
+void touch(void *fsptr, nodei node)
 {
 	fsheader *fshead=fsptr;
 	inode *nodetbl=O2P(fshead->nodetbl);
+	struct timespec access;
 	
-	if(pos==NULL) return;
-	if(nodevalid(fsptr,node)<NODEI_GOOD){
-		pos->node=NONODE;
-		return;
-	}pos->node=node;
-	pos->nblk=0;
-	pos->opos=0;
-	pos->dpos=0;
-	pos->oblk=NULLOFF;
-	pos->dblk=nodetbl[node].blocks[0];
-	pos->data=pos->dblk*BLKSZ;
+	timespec_get(&access,TIME_UTC);
+	__atomic_store_n(&nodetbl[node].atime.tv_sec,access.tv_sec,__ATOMIC_RELAXED);
+	__atomic_store_n(&nodetbl[node].atime.tv_nsec,access.tv_nsec,__ATOMIC_RELAXED);
+	dirtyptr(fsptr,&nodetbl[node],sizeof(inode));
 }
 
-sz_blk advance(void *fsptr, fpos *pos, sz_blk blks)
+int metacarve(void *fsptr)
 {
 	fsheader *fshead=fsptr;
-	inode *nodetbl=O2P(fshead->nodetbl);
-	sz_blk adv=0;
-	size_t unit=1;
-	
-	if(pos==NULL || pos->node==NONODE || pos->dblk==NULLOFF) return 0;
-	if(nodetbl[pos->node].mode==DIRMODE) unit=sizeof(direntry);
-	
-	if(pos->data==NULLOFF){
-		if(pos->dpos*unit==BLKSZ) pos->opos--;
-	}pos->dpos=0;
-	while(blks){
-		blkdex opos=pos->opos+1;
-		if(pos->oblk==NULLOFF){
-			if(opos==OFFS_NODE){
-				if((pos->oblk=nodetbl[pos->node].blocklist)==NULLOFF) break;
-				offblock *offs=B2P(pos->oblk);
-				pos->dblk=offs->blocks[opos=0];
-			}else{
-				if(nodetbl[pos->node].blocks[opos]==NULLOFF) break;
-				pos->dblk=nodetbl[pos->node].blocks[opos];
-			}
-		}else{
-			offblock *offs=B2P(pos->oblk);
-			if(opos==OFFS_BLOCK){
-				if(offs->next==NULLOFF) break;
-				pos->oblk=offs->next;
-				offs=(offblock*)B2P(pos->oblk);
-				pos->dblk=offs->blocks[opos=0];
-			}else{
-				if(offs->blocks[opos]==NULLOFF) break;
-				pos->dblk=offs->blocks[opos];
-			}
-		}pos->opos=opos;
-		adv++; blks--;
-	}pos->data=pos->dblk*BLKSZ;
-	pos->nblk+=adv;
-	return adv;
+	sz_blk metasz=metasize(fshead);
+	blkset metablk=fshead->size-metasz, freeoff=fshead->freelist;
+	freereg *prev=NULL;
+	
+	while(freeoff!=NULLOFF){
+		freereg *fhead=B2P(freeoff);
+		if(freeoff+fhead->size>=fshead->size){
+			if(freeoff>metablk) return -1;
+			if(freeoff<metablk) fhead->size=metablk-freeoff;
+			else if(prev!=NULL) prev->next=fhead->next;
+			else fshead->freelist=fhead->next;
+			fshead->free-=metasz;
+			return 0;
+		}prev=fhead;
+		freeoff=fhead->next;
+	}return -1;
 }
 
-size_t seek(void *fsptr, fpos *pos, size_t off)
+//Older images keep fixed size entries, FILES_DIR to a block; they are read out and appended again packed
+int dirpack(void *fsptr, nodei dir)
 {
 	fsheader *fshead=fsptr;
 	inode *nodetbl=O2P(fshead->nodetbl);
-	size_t adv=0, bck=0, unit=1;
-	sz_blk blks;
-	
-	if(pos==NULL || pos->node==NONODE || pos->data==NULLOFF) return 0;
-	if(nodetbl[pos->node].mode==DIRMODE) unit=sizeof(direntry);
-	
-	if((blks=(off+pos->dpos)*unit/BLKSZ)>0){
-		off=(off+pos->dpos)%(BLKSZ/unit);
-		bck=pos->dpos;
-		if((adv=advance(fsptr,pos,blks))<blks){
-			off=BLKSZ/unit;
-		}adv*=BLKSZ/unit;
-	}while(pos->data!=NULLOFF && off>0){
-		pos->dpos++;
-		if((pos->nblk*BLKSZ/unit+pos->dpos)==nodetbl[pos->node].size){
-			if(pos->dpos==BLKSZ/unit) pos->opos++;
-			pos->data=NULLOFF;
-		}else{
-			pos->data=pos->dblk*BLKSZ+pos->dpos*unit;
-			adv++; off--;
+	size_t count=nodetbl[dir].size, i;
+	direntry *ents=NULL;
+	sz_blk run;
+	
+	if(count>0 && (ents=(direntry*)malloc(count*sizeof(direntry)))==NULL) return -1;
+	for(i=0;i<count;i++) ents[i]=((direntry*)B2P(bmap(fsptr,dir,i/FILES_DIR,&run)))[i%FILES_DIR];
+	exttrunc(fsptr,&(xnodes(fsptr)[dir].map.hdr),0);
+	nodetbl[dir].nblocks=0;
+	nodetbl[dir].size=0;
+	for(i=0;i<count && ents[i].node!=NONODE;i++){
+		ents[i].name[NAMELEN-1]='\0';
+		if(dirput(fsptr,dir,ents[i].name,ents[i].node)==-1){
+			free(ents);
+			return -1;
 		}
-	}return (adv-bck);
+	}free(ents);
+	return 0;
 }
 
-int frealloc(void *fsptr, nodei node, size_t size)
+int upgrade(void *fsptr)
 {
 	fsheader *fshead=fsptr;
 	inode *nodetbl=O2P(fshead->nodetbl);
-	fpos pos;
-	ssize_t blkdiff;
-	sz_blk blksize;
+	fsmeta *meta=getmeta(fsptr);
+	xinode *xnodetbl=xnodes(fsptr);
+	nodei nodect=fshead->ntsize*NODES_BLOCK-1;
 	
-	loadpos(fsptr,&pos,node);
-	if(pos.node==NONODE || nodetbl[pos.node].mode==DIRMODE) return -1;
-	
-	blksize=CLDIV(size,BLKSZ);
-	blkdiff=blksize-nodetbl[node].nblocks;
-	if(blkdiff<0){
-		sz_blk fct=0,adv=0;
-		offblock *offs;
-		if(blksize<=OFFS_NODE){
-			fct=OFFS_NODE-blksize;
-			advance(fsptr,&pos,blksize);
-			if(fct!=0){
-				adv=advance(fsptr,&pos,fct);
-				blkfree(fsptr,fct,&(nodetbl[node].blocks[blksize]));
-			}blkfree(fsptr,1,&(nodetbl[node].blocklist));
-		}else{
-			advance(fsptr,&pos,blksize-1);
-			offs=(offblock*)B2P(pos.oblk);
-			advance(fsptr,&pos,1);
-			if(pos.opos>0){
-				fct=OFFS_BLOCK-pos.opos;
-				adv=advance(fsptr,&pos,fct);
-				blkfree(fsptr,fct,&(offs->blocks[OFFS_BLOCK-fct]));
-			}offs->next=NULLOFF;
-		}while(adv==fct){
-			offs=(offblock*)B2P(pos.oblk);
-			blkset prev=pos.oblk;
-			fct=OFFS_BLOCK;
-			adv=advance(fsptr,&pos,fct);
-			blkfree(fsptr,fct,offs->blocks);
-			blkfree(fsptr,1,&prev);
-		}
-	}else if(size>nodetbl[node].size){
-		seek(fsptr,&pos,nodetbl[node].size);
-		if(pos.dblk!=NULLOFF && pos.dpos<BLKSZ){
-			memset(O2P(pos.dblk*BLKSZ+pos.dpos),0,BLKSZ-pos.dpos);
-			pos.opos++;
-		}if(blkdiff>0){
-			offblock *offs;
-			blkset *tblks;
-			sz_blk noblks,alloct;
-			
-			if(pos.oblk==NULLOFF){
-				noblks=(blkdiff+pos.opos+(OFFS_BLOCK-OFFS_NODE)-1)/OFFS_BLOCK;
-			}else{
-				noblks=(blkdiff+pos.opos-1)/OFFS_BLOCK;
-			}
-			
-			if((tblks=(blkset*)malloc((blkdiff+noblks)*sizeof(blkset)))==NULL) return -1;
-			if(blkalloc(fsptr,blkdiff+noblks,tblks)<(blkdiff+noblks)){
-				blkfree(fsptr,blkdiff+noblks,tblks);
-				free(tblks);
+	for(;meta->upgrade<nodect;meta->upgrade++){
+		nodei node=meta->upgrade;
+		sz_blk nblocks=nodetbl[node].nblocks, ct, run;
+		blkset *dblks, oblk=nodetbl[node].blocklist;
+		
+		memset(&xnodetbl[node],0,sizeof(xinode));
+		if(nodetbl[node].blocks[0]==NULLOFF){
+			nodetbl[node].size=nodetbl[node].nblocks=0;
+			continue;
+		}if((dblks=(blkset*)malloc(nblocks*sizeof(blkset)))==NULL) return -1;
+		for(ct=0;ct<nblocks && ct<OFFS_NODE;ct++) dblks[ct]=nodetbl[node].blocks[ct];
+		while(ct<nblocks && oblk!=NULLOFF){
+			offblock *offs=B2P(oblk);
+			for(run=0;run<OFFS_BLOCK && ct<nblocks;run++) dblks[ct++]=offs->blocks[run];
+			oblk=offs->next;
+		}for(nblocks=0;nblocks<ct;nblocks+=run){
+			for(run=1;nblocks+run<ct && dblks[nblocks+run]==dblks[nblocks]+run;run++);
+			if(extinsert(fsptr,&xnodetbl[node].map.hdr,nblocks,dblks[nblocks],run)==-1){
+				extdrop(fsptr,&xnodetbl[node].map.hdr);
+				free(dblks);
 				return -1;
 			}
-			
-			nodetbl[node].size=nodetbl[node].nblocks*BLKSZ;
-			seek(fsptr,&pos,BLKSZ);
-			alloct=0;
-			while(alloct<(noblks+blkdiff)){
-				if(pos.oblk==NULLOFF){
-					if(pos.opos==OFFS_NODE){
-						nodetbl[node].blocklist=tblks[alloct++];
-						offs=(offblock*)B2P(nodetbl[node].blocklist);
-						pos.opos=0; pos.oblk=nodetbl[node].blocklist;
-						offs->blocks[0]=tblks[alloct];
-					}else{
-						nodetbl[node].blocks[pos.opos]=tblks[alloct];
-					}
-				}else{
-					offs=(offblock*)B2P(pos.oblk);
-					if(pos.opos==OFFS_BLOCK){
-						offs->next=tblks[alloct++];
-						pos.oblk=offs->next;
-						offs=(offblock*)B2P(offs->next);
-						pos.opos=0;
-					}offs->blocks[pos.opos]=tblks[alloct];
-				}alloct++;
-				nodetbl[node].size+=BLKSZ;
-				nodetbl[node].nblocks++;
-				pos.opos++;
-			}free(tblks);
+		}free(dblks);
+		
+		oblk=(ct>OFFS_NODE)?nodetbl[node].blocklist:NULLOFF;
+		while(oblk!=NULLOFF){
+			blkset next=((offblock*)B2P(oblk))->next;
+			blkfree(fsptr,1,&oblk);
+			oblk=next;
+		}for(run=0;run<OFFS_NODE;run++) nodetbl[node].blocks[run]=NULLOFF;
+		nodetbl[node].blocklist=NULLOFF;
+		nodetbl[node].nblocks=ct;
+		if(nodetbl[node].mode==DIRMODE){
+			nodetbl[node].size=MIN(nodetbl[node].size,ct*FILES_DIR);
+			if(dirpack(fsptr,node)==-1) return -1;
+			if(nodetbl[node].size>DIRHASH_MIN) hashgrow(fsptr,node,hashsize(nodetbl[node].size));
+		}else{
+			nodetbl[node].size=MIN(nodetbl[node].size,ct*BLKSZ);
+			xnodetbl[node].valid=nodetbl[node].size;
 		}
-	}nodetbl[node].nblocks=blksize;
-	nodetbl[node].size=size;
+	}nodelist(fsptr);
+	meta->upgrade=NONODE;
 	return 0;
 }
 
-void namepathset(char *name, const char *path)
+void metaformat(void *fsptr, nodei upgrade)
 {
-	size_t len=0;
-	if(name==path) return;
-	while(path[len]!='/' && path[len]!='\0'){
-		name[len]=path[len];
-		if(++len==NAMELEN-1) break;
-	}name[len]='\0';
+	fsheader *fshead=fsptr;
+	blkset metablk=fshead->size-metasize(fshead);
+	fsmeta *meta=getmeta(fsptr);
+	size_t i;
+	
+	memset(B2P(metablk),0,metasize(fshead)*BLKSZ);
+	meta->magic=FSMETA_MAGIC;
+	meta->upgrade=upgrade;
+	meta->metablk=metablk;
+	meta->xnodetbl=metablk*BLKSZ;
+	meta->dcache=meta->xnodetbl+CLDIV((fshead->ntsize*NODES_BLOCK-1)*sizeof(xinode),BLKSZ)*BLKSZ;
+	meta->dcsize=dcachesize(fshead);
+	meta->dgen=1;
+	meta->orphans=NONODE;
+	meta->bitmap=meta->dcache+CLDIV(meta->dcsize*sizeof(dentry),BLKSZ)*BLKSZ;
+	meta->bmtree=meta->bitmap+CLDIV(CLDIV(fshead->size,64)*sizeof(uint64_t),BLKSZ)*BLKSZ;
+	meta->bmleaves=leafcount(fshead);
+	meta->ofiles=meta->bmtree+CLDIV(2*meta->bmleaves*sizeof(bmsum),BLKSZ)*BLKSZ;
+	meta->locks=meta->ofiles+CLDIV(FILES_OPEN*sizeof(ofile),BLKSZ)*BLKSZ;
+	meta->groups=meta->locks+CLDIV(sizeof(fslocks),BLKSZ)*BLKSZ;
+	meta->ngroups=groupcount(fshead);
+	meta->dirty=meta->groups+CLDIV(meta->ngroups*sizeof(agroup),BLKSZ)*BLKSZ;
+	meta->jmap=meta->dirty+CLDIV(CLDIV(fshead->size,64)*sizeof(uint64_t),BLKSZ)*BLKSZ;
+	meta->stats=meta->jmap+CLDIV(CLDIV(fshead->size,64)*sizeof(uint64_t),BLKSZ)*BLKSZ;
+	meta->mnt.ckfd=-1;
+	for(i=0;i<meta->ngroups;i++) ((agroup*)O2P(meta->groups))[i].freenode=NONODE;
 }
-int namepatheq(char *name, const char *path)
+
+//Locks live in the meta region with everything they guard, and whatever state an earlier process left them in is
+//discarded on mount, before anything takes them
+void lockinit(void *fsptr)
 {
-	size_t len=0;
-	if(name==path) return 1;
-	while(path[len]!='/' && path[len]!='\0'){
-		if(name[len]=='\0' || name[len]!=path[len]) return 0;
-		if(++len==NAMELEN) return 1;
-	}return (name[len]=='\0');
+	fslocks *locks=getlocks(fsptr);
+	agroup *groups=O2P(getmeta(fsptr)->groups);
+	size_t i;
+	
+	pthread_mutex_init(&locks->orphans,NULL);
+	for(i=0;i<DCACHE_LOCKS;i++) pthread_mutex_init(&locks->dcache[i],NULL);
+	for(i=0;i<OFILE_LOCKS;i++) pthread_mutex_init(&locks->ofiles[i],NULL);
+	for(i=0;i<NODE_LOCKS;i++) pthread_rwlock_init(&locks->nodes[i],NULL);
+	for(i=0;i<getmeta(fsptr)->ngroups;i++) pthread_mutex_init(&groups[i].lock,NULL);
 }
 
-nodei dirmod(void *fsptr, nodei dir, const char *name, nodei node, const char *rename)
+//Older images keep free space as a list of regions written into the free blocks themselves
+void bmload(void *fsptr)
 {
 	fsheader *fshead=fsptr;
-	inode *nodetbl=O2P(fshead->nodetbl);
-	blkset oblk=NULLOFF, prevo=NULLOFF;
-	blkset dblk=nodetbl[dir].blocks[0];
-	direntry *df, *found=NULL;
-	blkdex block=0, entry=0;
+	blkset freeoff=fshead->freelist;
 	
-	if(nodevalid(fsptr,dir)<NODEI_LINKD || nodetbl[dir].mode!=DIRMODE) return NONODE;
-	if(node!=NONODE && rename==NULL && nodevalid(fsptr,node)<NODEI_GOOD) return NONODE;
-	if(*name=='\0' || (rename!=NULL && node==NONODE && *rename=='\0')) return NONODE;
+	while(freeoff!=NULLOFF){
+		freereg *fhead=B2P(freeoff);
+		bmmark(fsptr,freeoff,fhead->size,1);
+		freeoff=fhead->next;
+	}fshead->freelist=NULLOFF;
+}
+void groupload(void *fsptr)
+{
+	fsmeta *meta=getmeta(fsptr);
+	uint64_t *map=O2P(meta->bitmap);
+	agroup *groups=O2P(meta->groups);
+	size_t i;
 	
-	while(dblk!=NULLOFF){
-		df=(direntry*)B2P(dblk);
-		while(entry<FILES_DIR){
-			if(df[entry].node==NONODE) break;
-			if(node==NONODE && rename!=NULL && namepatheq(df[entry].name,rename)){
-				return NONODE;
-			}if(namepatheq(df[entry].name,name)){
-				if(rename!=NULL) found=&df[entry];
-				else{
-					if(node==NONODE) return df[entry].node;
-					else return NONODE;
-				}
-			}entry++;
-		}if(entry<FILES_DIR) break;
-		block++; entry=0;
-		if(oblk==NULLOFF){
-			if(block==OFFS_NODE){
-				if((oblk=nodetbl[dir].blocklist)==NULLOFF){
-					dblk=NULLOFF;
-				}else{
-					offblock *offs=B2P(oblk);
-					dblk=offs->blocks[block=0];
-				}
-			}else dblk=nodetbl[dir].blocks[block];
-		}else{
-			offblock *offs=B2P(oblk);
-			if(block==OFFS_BLOCK){
-				if(offs->next==NULLOFF) dblk=NULLOFF;
-				else{
-					prevo=oblk;
-					oblk=offs->next;
-					offs=(offblock*)B2P(oblk);
-					dblk=offs->blocks[block=0];
-				}
-			}else dblk=offs->blocks[block];
-		}
-	}if(node==NONODE){
-		if(rename!=NULL && found!=NULL){
-			namepathset(found->name,rename);
-			return found->node;
-		}return NONODE;
-	}if(rename!=NULL){
-		if(found==NULL) return NONODE;
-		node=found->node;
-		if(nodetbl[node].mode==DIRMODE && nodetbl[node].nlinks==1 && nodetbl[node].size>0) return NONODE;
-		if(dblk!=NULLOFF) entry--;
-		else{
-			if(oblk==NULLOFF){
-				dblk=nodetbl[dir].blocks[--block];
-			}else{
-				offblock *offs=B2P(oblk);
-				dblk=offs->blocks[--block];
-			}entry=FILES_DIR-1;
-		}df=(direntry*)B2P(dblk);
-		found->node=df[entry].node;
-		namepathset(found->name,df[entry].name);
-		df[entry].node=NONODE;
-		if(entry==0){
-			if(oblk==NULLOFF){
-				blkfree(fsptr,1,&(nodetbl[dir].blocks[block]));
-			}else{
-				offblock *offs=B2P(oblk);
-				blkfree(fsptr,1,&(offs->blocks[block]));
-				if(block==0){
-					if(prevo==NULLOFF){
-						blkfree(fsptr,1,&(nodetbl[dir].blocklist));
-					}else{
-						offs=(offblock*)B2P(prevo);
-						blkfree(fsptr,1,&(offs->next));
-					}
-				}
-			}nodetbl[dir].nblocks--;
-		}nodetbl[dir].size--;
-		//update dir node times?
-		nodetbl[node].nlinks--;
-		return node;
-	}if(dblk==NULLOFF){
-		offblock *offs;
-		if(oblk==NULLOFF){
-			if(block==OFFS_NODE){
-				if(blkalloc(fsptr,1,&oblk)==0){
-					return NONODE;
-				}if(blkalloc(fsptr,1,&dblk)==0){
-					blkfree(fsptr,1,&oblk);
-					return NONODE;
-				}nodetbl[dir].blocklist=oblk;
-				offs=(offblock*)B2P(oblk);
-				offs->blocks[0]=dblk;
-				offs->blocks[1]=NULLOFF;
-				offs->next=NULLOFF;
-			}else{
-				if(blkalloc(fsptr,1,&dblk)==0){
-					return NONODE;
-				}nodetbl[dir].blocks[block]=dblk;
-				if(block<OFFS_NODE-1) nodetbl[dir].blocks[block+1]=NULLOFF;
-			}
-		}else{
-			offs=(offblock*)B2P(oblk);
-			if(block==OFFS_BLOCK){
-				if(blkalloc(fsptr,1,&oblk)==0){
-					return NONODE;
-				}if(blkalloc(fsptr,1,&dblk)==0){
-					blkfree(fsptr,1,&oblk);
-					return NONODE;
-				}offs->next=oblk;
-				offs=(offblock*)B2P(oblk);
-				offs->next=NULLOFF;
-				block=0;
-			}else{
-				if(blkalloc(fsptr,1,&dblk)==0){
-					return NONODE;
-				}
-			}offs->blocks[block]=dblk;
-			offs->blocks[1]=NULLOFF;
-		}nodetbl[dir].nblocks++;
-		df=(direntry*)B2P(dblk);
-	}nodetbl[dir].size++;
-	df[entry].node=node;
-	namepathset(df[entry].name,name);
-	nodetbl[node].nlinks++;
-	if(++entry<FILES_DIR) df[entry].node=NONODE;
-	return node;
+	for(i=0;i<CLDIV(meta->metablk,64);i++) groups[64*i/groupspan(meta)].free+=__builtin_popcountll(map[i]);
 }
 
-nodei path2node(void *fsptr, const char *path, const char **child)
+//Blocks taken by the log header listing count blocks
+sz_blk loghead(sz_blk count)
+{
+	return CLDIV(offsetof(loghdr,blks)+count*sizeof(blkset),BLKSZ);
+}
+uint64_t logsum(uint64_t *words, size_t count)
 {
-	nodei node=0;
-	size_t sub=1, ch=1;
+	uint64_t sum=0xcbf29ce484222325ULL;
+	size_t i;
 	
-	if(path[0]!='/') return NONODE;
+	for(i=0;i<count;i++) sum=(sum^words[i])*0x100000001b3ULL;
+	return sum;
+}
+//A batch counts only if its header, block list and every copy made it to the disk whole; a torn one fails the sum
+//and is dropped, as the home writes it stood for had not started
+loghdr *logcheck(void *fsptr, int slot)
+{
+	fsheader *fshead=fsptr;
+	loghdr *hdr=getlog(fsptr,slot);
+	sz_blk len=logsize(fshead), i;
+	blkset start=fshead->size-1-len;
 	
-	while(path[sub=ch]!='\0'){
-		while(path[ch]!='\0'){
-			if(path[ch++]=='/') break;
-		}if(child!=NULL && path[ch]=='\0'){
-			*child=&path[sub];
-			break;
-		}if((node=dirmod(fsptr,node,&path[sub],NONODE,NULL))==NONODE)
-			return NONODE;
-	}return node;
+	if(len+1>=fshead->size || hdr->magic!=LOG_MAGIC || hdr->count==0 || hdr->count>len/2) return NULL;
+	if(loghead(hdr->count)+hdr->count>len/2) return NULL;
+	for(i=0;i<hdr->count;i++){
+		if(hdr->blks[i]>=fshead->size || (hdr->blks[i]>=start && hdr->blks[i]<start+len)) return NULL;
+	}if(logsum(&hdr->seq,((loghead(hdr->count)+hdr->count)*BLKSZ-offsetof(loghdr,seq))/sizeof(uint64_t))!=hdr->sum) return NULL;
+	return hdr;
+}
+//Only the newer of two whole batches is replayed: the home writes of the older were synced before it was written
+loghdr *lognewest(void *fsptr)
+{
+	loghdr *hdr=logcheck(fsptr,0), *other=logcheck(fsptr,1);
+	
+	if(hdr==NULL || (other!=NULL && other->seq>hdr->seq)) return other;
+	return hdr;
+}
+//Copies a committed batch back over its home blocks. This runs before the meta header is looked at, as the header
+//is one of the blocks the batch may hold. The mount stamp in block 0 holds the claim of the call replaying, and is
+//left alone
+void logreplay(void *fsptr)
+{
+	loghdr *hdr=lognewest(fsptr);
+	size_t gate=(char*)getstamp(fsptr)-(char*)fsptr;
+	char *src;
+	sz_blk i;
+	
+	if(hdr==NULL) return;
+	for(i=0;i<hdr->count;i++){
+		src=(char*)hdr+(loghead(hdr->count)+i)*BLKSZ;
+		if(hdr->blks[i]!=0) memcpy(B2P(hdr->blks[i]),src,BLKSZ);
+		else{
+			memcpy(fsptr,src,gate);
+			memcpy((char*)fsptr+gate+sizeof(uint64_t),src+gate+sizeof(uint64_t),BLKSZ-gate-sizeof(uint64_t));
+		}
+	}
+}
+//Blocks replayed are only right in memory, so they go into the next batch, which takes the other slot and so leaves
+//this one whole until it is committed
+void logreset(void *fsptr)
+{
+	fsmeta *meta=getmeta(fsptr);
+	loghdr *hdr=lognewest(fsptr);
+	sz_blk i;
+	
+	if(hdr!=NULL){
+		for(i=0;i<hdr->count;i++) dirty(fsptr,hdr->blks[i],1);
+		if(hdr->seq>meta->jseq) meta->jseq=hdr->seq;
+	}getlog(fsptr,0)->magic=0;
+	getlog(fsptr,1)->magic=0;
 }
 
-void fsinit(void *fsptr, size_t fssize)
+int fsinit(void *fsptr, size_t fssize)
 {
 	fsheader *fshead=fsptr;
-	freereg *fhead;
+	fsmeta *meta;
 	inode *nodetbl;
 	struct timespec creation;
+	sz_blk metasz;
 	
-	if(fshead->size==fssize/BLKSZ) return;
+	if(fshead->size==fssize/BLKSZ){
+		if(fshead->nodetbl!=sizeof(inode) || fshead->ntsize==0 || fshead->ntsize>=fshead->size) return -1;
+		logreplay(fsptr);
+		meta=getmeta(fsptr);
+		if(meta->magic!=FSMETA_MAGIC){
+			if(metacarve(fsptr)==-1) return -1;
+			metaformat(fsptr,0);
+			bmload(fsptr);
+			groupload(fsptr);
+		}if(meta->metablk!=fshead->size-metasize(fshead)) return -1;
+		lockinit(fsptr);
+		dirtyreset(fsptr,meta->upgrade!=NONODE);
+		logreset(fsptr);
+		if(meta->upgrade!=NONODE) return upgrade(fsptr);
+		return 0;
+	}
 	
 	fshead->ntsize=(BLOCKS_FILE*(1+NODES_BLOCK)+fssize/BLKSZ)/(1+BLOCKS_FILE*NODES_BLOCK);
 	fshead->nodetbl=sizeof(inode);
-	fshead->freelist=fshead->ntsize;
-	fshead->free=fssize/BLKSZ-fshead->ntsize;
-	
-	fhead=(freereg*)B2P(fshead->freelist);
-	fhead->size=fshead->free;
-	fhead->next=NULLOFF;
+	fshead->size=fssize/BLKSZ;
+	metasz=metasize(fshead);
+	if(fshead->ntsize+metasz>=fshead->size){
+		fshead->size=0;
+		return -1;
+	}fshead->freelist=NULLOFF;
+	fshead->free=0;
+	metaformat(fsptr,NONODE);
+	lockinit(fsptr);
+	dirtyreset(fsptr,1);
+	runfree(fsptr,fshead->ntsize,fshead->size-fshead->ntsize-metasz);
 	
 	nodetbl=(inode*)O2P(fshead->nodetbl);
 	memset(nodetbl,0,fshead->ntsize*BLKSZ-sizeof(inode));
@@ -723,32 +2494,488 @@ void fsinit(void *fsptr, size_t fssize)
 	nodetbl[0].ctime=creation;
 	nodetbl[0].mtime=creation;
 	nodetbl[0].nlinks=1;
+	nodelist(fsptr);
+	return 0;
+}
+
+//A block as it is written out: the mount stamp in block 0 and the mount fields of the meta header only mean something
+//to this process, so they go out cleared and no later process can take them for its own. They are also the only
+//bytes of those blocks written without the locks a flush holds, so they are not read at all
+void blkcopy(void *fsptr, blkset blk, char *buf)
+{
+	fsheader *fshead=fsptr;
+	char *src=B2P(blk);
+	size_t from=0, len=0;
 	
-	fshead->size=fssize/BLKSZ;
+	if(blk==0){
+		from=(char*)getstamp(fsptr)-(char*)fsptr;
+		len=sizeof(uint64_t);
+	}else if(blk==fshead->size-1){
+		from=offsetof(fsmeta,mnt);
+		len=sizeof(mntinfo);
+	}memcpy(buf,src,from);
+	memset(buf+from,0,len);
+	memcpy(buf+from+len,src+from+len,BLKSZ-from-len);
+	if(blk==fshead->size-1) ((fsmeta*)buf)->mnt.ckfd=((fsmeta*)buf)->mnt.trfd=-1;
+}
+int fdwrite(int fd, char *buf, size_t len, off_t off)
+{
+	size_t done;
+	ssize_t got;
+	
+	for(done=0;done<len;done+=got){
+		if((got=pwrite(fd,buf+done,len-done,off+done))<=0){
+			if(got==0) errno=EIO;
+			return -1;
+		}
+	}return 0;
+}
+//Writes one run of blocks to the backup file at their own offset, or syncs it in place when the image is a shared
+//mapping of the file, widened to whole pages as msync wants. A shared mapping is the file, so the stamp and mount
+//fields go out as they are; the exec key in the stamp keeps it from matching in any other process
+int flushrun(void *fsptr, int fd, blkset blk, sz_blk count)
+{
+	fsheader *fshead=fsptr;
+	char *start=B2P(blk), copy[BLKSZ];
+	size_t skew;
+	
+	if(fd<0){
+		skew=(size_t)start%(size_t)sysconf(_SC_PAGESIZE);
+		return msync(start-skew,count*BLKSZ+skew,MS_SYNC);
+	}if(blk==0){
+		blkcopy(fsptr,0,copy);
+		if(fdwrite(fd,copy,BLKSZ,0)==-1) return -1;
+		blk++;
+		count--;
+	}if(count>0 && blk+count==fshead->size){
+		blkcopy(fsptr,fshead->size-1,copy);
+		if(fdwrite(fd,copy,BLKSZ,(fshead->size-1)*BLKSZ)==-1) return -1;
+		count--;
+	}return fdwrite(fd,B2P(blk),count*BLKSZ,blk*BLKSZ);
+}
+//Writes both slot headers, whose magic is only ever set in memory while a batch is written out, back over the disk
+//copies, so that neither batch there can be replayed over blocks written in place since
+int logstrike(void *fsptr, int fd)
+{
+	fsheader *fshead=fsptr;
+	fsmeta *meta=getmeta(fsptr);
+	sz_blk len=logsize(fshead)/2;
+	blkset start=fshead->size-1-2*len;
+	
+	if(flushrun(fsptr,fd,start,1)==-1 || flushrun(fsptr,fd,start+len,1)==-1) return -1;
+	if(fd>=0 && fdatasync(fd)==-1 && errno!=EINVAL) return -1;
+	meta->jlive=0;
+	return 0;
+}
+//Copies every block in the journal map into a log slot behind a header listing them, then writes and syncs it as
+//one sequential run: once that returns, a crash anywhere in the home writes that follow is put right at mount. Home
+//writes still in flight from the batch before are synced first, so a newer batch never reaches the disk ahead of
+//them; the slots take turns, so that batch stays whole until this one is. A batch too big for a slot is not logged,
+//and 1 is returned once both slots are struck out on disk, so that neither can be replayed over the blocks written
+//in place
+int logcommit(void *fsptr, int fd)
+{
+	fsheader *fshead=fsptr;
+	fsmeta *meta=getmeta(fsptr);
+	size_t seq=meta->jseq+1;
+	loghdr *hdr=getlog(fsptr,seq%2);
+	sz_blk len=logsize(fshead)/2, head, i;
+	blkset blk, start=fshead->size-1-2*len;
+	int ret=0;
+	
+	hdr->count=0;
+	for(blk=dirtyscan(fsptr,O2P(meta->jmap),0,1);ret==0 && blk<fshead->size;blk=dirtyscan(fsptr,O2P(meta->jmap),blk+1,1)){
+		if(loghead(hdr->count+1)+hdr->count+1>len) ret=1;
+		else hdr->blks[hdr->count++]=blk;
+	}if(ret==0 && hdr->count==0) return 0;
+	if(meta->jpend && fdatasync(fd)==-1 && errno!=EINVAL) return -1;
+	meta->jpend=0;
+	if(ret==1) return (meta->jlive && logstrike(fsptr,fd)==-1)?-1:1;
+	head=loghead(hdr->count);
+	for(i=0;i<hdr->count;i++) blkcopy(fsptr,hdr->blks[i],(char*)hdr+(head+i)*BLKSZ);
+	hdr->seq=seq;
+	hdr->sum=logsum(&hdr->seq,((head+hdr->count)*BLKSZ-offsetof(loghdr,seq))/sizeof(uint64_t));
+	hdr->magic=LOG_MAGIC;
+	ret=flushrun(fsptr,fd,start+(seq%2)*len,head+hdr->count);
+	hdr->magic=0;
+	if(ret==0 && fdatasync(fd)==-1 && errno!=EINVAL) ret=-1;
+	if(ret==0){
+		meta->jseq=seq;
+		meta->jlive=1;
+		statcount(fsptr,CT_LOGGED,hdr->count);
+	}return ret;
+}
+//Holding every node stripe and then the cache, open file and orphan list locks keeps the image still while it
+//is written, so what reaches the file is a state some call left it in. Metadata goes through the log first when
+//it fits, and an msync never runs while a batch from an earlier backup-file flush may still be found on disk; after that, dirty runs closer than FLUSH_GAP are joined, clean blocks and all, into one sequential write
+//that never takes in the stats or the log, and runs that fail stay dirty for the next flush. A full flush syncs
+//the home writes too, where a logged one leaves them to be synced before the next commit. Orphaned blocks are
+//reclaimed first, before any lock is taken, so the blocks they free go out in the same flush: all of them for a
+//sync, and a bounded step for a checkpoint, which runs on whichever call came in first
+int fsflush(void *fsptr, int fd, int full, sz_blk *written)
+{
+	fsheader *fshead=fsptr;
+	fsmeta *meta=getmeta(fsptr);
+	fslocks *locks=getlocks(fsptr);
+	uint64_t *map=O2P(meta->dirty), *jmap=O2P(meta->jmap), bit;
+	blkset blk, end, next, i, stop=meta->stats/BLKSZ;
+	int ret, logged;
+	
+	if(__atomic_load_n(&meta->orphans,__ATOMIC_RELAXED)!=NONODE) nodereap(fsptr,full?~(sz_blk)0:RECLAIM_STEP);
+	for(i=0;i<NODE_LOCKS;i++) pthread_rwlock_wrlock(&locks->nodes[i]);
+	for(i=0;i<DCACHE_LOCKS;i++) pthread_mutex_lock(&locks->dcache[i]);
+	for(i=0;i<OFILE_LOCKS;i++) pthread_mutex_lock(&locks->ofiles[i]);
+	pthread_mutex_lock(&locks->orphans);
+	dirty(fsptr,fshead->size-1,1);
+	*written=0;
+	ret=(fd>=0)?logcommit(fsptr,fd):(meta->jlive && logstrike(fsptr,fd)==-1)?-1:1;
+	logged=(ret==0);
+	if(ret==1) ret=0;
+	if(fd>=0) meta->jpend=1;
+	for(blk=dirtyscan(fsptr,map,0,1);ret==0 && blk<fshead->size;blk=dirtyscan(fsptr,map,end,1)){
+		end=dirtyscan(fsptr,map,blk,0);
+		while(end<fshead->size && (next=dirtyscan(fsptr,map,end,1))<fshead->size && next-end<=FLUSH_GAP
+			&& (next<=stop || end>=fshead->size-1)){
+			end=dirtyscan(fsptr,map,next,0);
+		}if((ret=flushrun(fsptr,fd,blk,end-blk))==-1) break;
+		for(i=blk;i<end;i++){
+			bit=(uint64_t)1<<(i%64);
+			map[i/64]&=~bit;
+			jmap[i/64]&=~bit;
+		}*written+=end-blk;
+	}if(ret==0 && fd>=0 && (full || !logged)){
+		if(fdatasync(fd)==-1 && errno!=EINVAL) ret=-1;
+		else meta->jpend=0;
+	}if(ret==0) __atomic_store_n(&meta->jdirty,0,__ATOMIC_RELAXED);
+	statcount(fsptr,CT_FLUSHED,*written);
+	pthread_mutex_unlock(&locks->orphans);
+	for(i=OFILE_LOCKS;i>0;i--) pthread_mutex_unlock(&locks->ofiles[i-1]);
+	for(i=DCACHE_LOCKS;i>0;i--) pthread_mutex_unlock(&locks->dcache[i-1]);
+	for(i=NODE_LOCKS;i>0;i--) pthread_rwlock_unlock(&locks->nodes[i-1]);
+	return ret;
+}
+
+//Whichever call first finds the interval up, or the batch half a slot, moves the deadline on and commits; a failed
+//checkpoint leaves its blocks dirty for the next one
+void checkpoint(void *fsptr, fsmeta *meta)
+{
+	struct timespec now;
+	size_t next=__atomic_load_n(&meta->mnt.cknext,__ATOMIC_RELAXED);
+	sz_blk written;
+	
+	timespec_get(&now,TIME_UTC);
+	if((size_t)now.tv_sec<next && __atomic_load_n(&meta->jdirty,__ATOMIC_RELAXED)<logsize(fsptr)/4) return;
+	if(__atomic_compare_exchange_n(&meta->mnt.cknext,&next,now.tv_sec+meta->mnt.ckint,0,__ATOMIC_RELAXED,
+		__ATOMIC_RELAXED)){
+		fsflush(fsptr,__atomic_load_n(&meta->mnt.ckfd,__ATOMIC_RELAXED),0,&written);
+	}
+}
+//The random bytes the kernel hands every program at exec, which a later process reusing this one's pid and mapping
+//address still will not have. This is the one thing kept outside the image, as it is what tells processes apart: it
+//is worked out on first use and never changes after, so threads racing to fill it in store the same value. A forked
+//child keeps it, and with it the mount, along with the descriptors and memory the mount refers to
+uint64_t mntkey(void)
+{
+	static uint64_t cached;
+	uint64_t key[2]={0,0}, mix;
+	void *rnd;
+	
+	if((mix=__atomic_load_n(&cached,__ATOMIC_RELAXED))!=0) return mix;
+	if((rnd=(void*)getauxval(AT_RANDOM))!=NULL) memcpy(key,rnd,sizeof(key));
+	mix=(key[0]^(key[1]>>29)^key[1])*0xbf58476d1ce4e5b9ULL;
+	mix=(mix!=0)?mix:1;
+	__atomic_store_n(&cached,mix,__ATOMIC_RELAXED);
+	return mix;
+}
+//What marks the image mounted by this process at this address and size: the process key mixed with both. The low bit
+//is kept clear for the claim taken while mounting
+uint64_t mntstamp(void *fsptr, size_t fssize)
+{
+	uint64_t stamp=(mntkey()^((uint64_t)(size_t)fsptr*0x9e3779b97f4a7c15ULL)^fssize)&~(uint64_t)1;
+	
+	return (stamp!=0)?stamp:2;
+}
+fsmeta *mounted(void *fsptr, size_t fssize)
+{
+	if(__atomic_load_n(getstamp(fsptr),__ATOMIC_ACQUIRE)!=mntstamp(fsptr,fssize)) return NULL;
+	return getmeta(fsptr);
+}
+//The mount phase runs once per process and mapping: the stamp left in the header slot lets every later call skip
+//straight to the operation, and anything that should happen once per mount belongs here. The image's own locks are
+//not set up until it is mounted, so calls racing to mount take turns through the stamp instead: the one that swaps
+//the claim (the stamp with its low bit set) in for whatever another process left there mounts, and writes the stamp
+//when done, or clears it if the image is no good; the others yield until it has, and so only ever read the image
+//once it is whole
+fsmeta *fsmount(void *fsptr, size_t fssize)
+{
+	uint64_t *gate=getstamp(fsptr), stamp, seen;
+	fsmeta *meta;
+	
+	if((meta=mounted(fsptr,fssize))==NULL){
+		stamp=mntstamp(fsptr,fssize);
+		seen=__atomic_load_n(gate,__ATOMIC_ACQUIRE);
+		while(seen!=stamp && (seen==(stamp|1) || !__atomic_compare_exchange_n(gate,&seen,stamp|1,0,__ATOMIC_ACQUIRE,
+			__ATOMIC_ACQUIRE))){
+			if(seen==(stamp|1)){
+				sched_yield();
+				seen=__atomic_load_n(gate,__ATOMIC_ACQUIRE);
+			}
+		}if(seen==stamp) meta=getmeta(fsptr);
+		else if(fsinit(fsptr,fssize)==0){
+			meta=getmeta(fsptr);
+			memset(O2P(meta->ofiles),0,FILES_OPEN*sizeof(ofile));
+			memset(O2P(meta->dcache),0,meta->dcsize*sizeof(dentry));
+			memset(O2P(meta->stats),0,sizeof(fsstats));
+			meta->mnt.ckfd=meta->mnt.trfd=-1;
+			meta->mnt.ckint=meta->mnt.cknext=0;
+			meta->mnt.trbase=0;
+			meta->jpend=meta->jlive=1;
+			meta->mounts++;
+			__atomic_store_n(gate,stamp,__ATOMIC_RELEASE);
+		}else{
+			__atomic_store_n(gate,0,__ATOMIC_RELEASE);
+			return NULL;
+		}
+	}if(__atomic_load_n(&meta->mnt.ckint,__ATOMIC_ACQUIRE)>0) checkpoint(fsptr,meta);
+	return meta;
+}
+int mountfail(int *errnoptr)
+{
+	*errnoptr=EFAULT;
+	return -1;
+}
+
+//Counts the call, and records it too while a trace is being taken. A record goes out in one write, so those of
+//concurrent calls never interleave, and they land in the order the calls returned; one that cannot be written is
+//dropped and counted, as the call has happened either way
+void opend(void *fsptr, fsmeta *meta, int op, uint64_t start, int64_t ret, int *errnoptr, const char *path,
+	const char *to, uint64_t fh, uint64_t off, uint64_t size, uint32_t arg)
+{
+	uint64_t ns=opdone(fsptr,meta,op,start,ret<0), base;
+	size_t plen, tlen;
+	trrec *rec;
+	int fd;
+	
+	if(meta==NULL || (fd=__atomic_load_n(&meta->mnt.trfd,__ATOMIC_ACQUIRE))<0) return;
+	base=__atomic_load_n(&meta->mnt.trbase,__ATOMIC_RELAXED);
+	plen=(path!=NULL)?strlen(path)+1:0;
+	tlen=(to!=NULL)?strlen(to)+1:0;
+	if((rec=malloc(sizeof(trrec)+plen+tlen))==NULL){
+		statcount(fsptr,CT_TRDROP,1);
+		return;
+	}rec->len=sizeof(trrec)+plen+tlen;
+	rec->err=(ret<0)?*errnoptr:0;
+	rec->op=op;
+	rec->arg=arg;
+	rec->ret=ret;
+	rec->start=(start>base)?start-base:0;
+	rec->ns=ns;
+	rec->fh=fh;
+	rec->off=off;
+	rec->size=size;
+	if(path!=NULL) memcpy((char*)(rec+1),path,plen);
+	if(to!=NULL) memcpy((char*)(rec+1)+plen,to,tlen);
+	if(write(fd,rec,rec->len)!=(ssize_t)rec->len) statcount(fsptr,CT_TRDROP,1);
+	free(rec);
+}
+
+int isstats(const char *path)
+{
+	return strcmp(path,STATS_PATH)==0;
+}
+int statsdeny(int *errnoptr, int err)
+{
+	*errnoptr=err;
+	return -1;
+}
+//Every number is printed at full width, so the text keeps one length for a stat and the reads that follow it
+size_t statsrender(void *fsptr, char *buf)
+{
+	const char *ops[STAT_OPS]=OP_NAMES;
+	const char *ctrs[CTRS]={"path2node","pathwalk","dirmod","dirscan","advance","advblocks","flushed","logged","tracedrop"};
+	fsmeta *meta=getmeta(fsptr);
+	fsstats *stats=O2P(meta->stats);
+	size_t len, i, j;
+	
+	ops[OP_FREALLOC]="frealloc";
+	len=snprintf(buf,STATS_LEN,"# op calls errors ns hist[0..%d]: calls taking under 2^(i+1) ns, the last any longer\n",STAT_BUCKETS-1);
+	for(i=0;i<STAT_OPS;i++){
+		len+=snprintf(buf+len,STATS_LEN-len,"%-10s %20llu %20llu %20llu",ops[i],
+			(unsigned long long)__atomic_load_n(&stats->ops[i].calls,__ATOMIC_RELAXED),
+			(unsigned long long)__atomic_load_n(&stats->ops[i].errors,__ATOMIC_RELAXED),
+			(unsigned long long)__atomic_load_n(&stats->ops[i].ns,__ATOMIC_RELAXED));
+		for(j=0;j<STAT_BUCKETS;j++){
+			len+=snprintf(buf+len,STATS_LEN-len," %20llu",(unsigned long long)__atomic_load_n(&stats->ops[i].hist[j],__ATOMIC_RELAXED));
+		}len+=snprintf(buf+len,STATS_LEN-len,"\n");
+	}for(i=0;i<CTRS;i++){
+		len+=snprintf(buf+len,STATS_LEN-len,"%-10s %20llu\n",ctrs[i],(unsigned long long)__atomic_load_n(&stats->counters[i],__ATOMIC_RELAXED));
+	}len+=snprintf(buf+len,STATS_LEN-len,"%-10s %20llu\n%-10s %20llu\n",
+		"dhits",(unsigned long long)__atomic_load_n(&meta->dhits,__ATOMIC_RELAXED),
+		"dmisses",(unsigned long long)__atomic_load_n(&meta->dmisses,__ATOMIC_RELAXED));
+	return len;
+}
+int statsattr(void *fsptr, size_t fssize, int *errnoptr, uid_t uid, gid_t gid, struct stat *stbuf)
+{
+	char *buf;
+	
+	if((buf=malloc(STATS_LEN))==NULL){
+		*errnoptr=EINVAL;
+		return -1;
+	}
+	
+	stbuf->st_uid=uid;
+	stbuf->st_gid=gid;
+	stbuf->st_mode=S_IFREG|0444;
+	stbuf->st_size=statsrender(fsptr,buf);
+	stbuf->st_nlink=1;
+	timespec_get(&stbuf->st_mtim,TIME_UTC);
+	stbuf->st_atim=stbuf->st_mtim;
+	stbuf->st_ctim=stbuf->st_mtim;
+	free(buf);
+	return 0;
+}
+//Each read renders the counters afresh and copies out its window of them
+int statsread(void *fsptr, size_t fssize, int *errnoptr, char *buf, size_t size, off_t off)
+{
+	char *text;
+	size_t len;
+	
+	if(off<0){
+		*errnoptr=EINVAL;
+		return -1;
+	}if((text=malloc(STATS_LEN))==NULL){
+		*errnoptr=EINVAL;
+		return -1;
+	}
+	
+	len=statsrender(fsptr,text);
+	size=((size_t)off>=len)?0:MIN(size,len-off);
+	memcpy(buf,text+off,size);
+	free(text);
+	return size;
 }
 
 /*Implementation Details
 	Filesystem layout
-		[ global header | root inode | ... inodes ... ] [ node table blocks ]... [ data blocks ]...
+		[ global header | root inode | ... inodes ... ] [ node table blocks ]... [ data blocks ]... [ extended inodes ]... [ lookup cache ]... [ free bitmap ]... [ bitmap summaries ]... [ open files ]... [ locks ]... [ allocation groups ]... [ dirty maps ]... [ stats ]... [ log ]... [ meta header ]
 	File layout
-		node{ first n data offsets }->first offset block{ next m data offsets }->...
+		extended node{ first n extents[logical block, first block, length] }
+		once a file needs more than n extents, they move into a tree of extent blocks rooted in the extended node:
+		extended node{ index[logical block, extent block] ... }->extent block{ extents or further index entries }...
 	Directory layout
-		{ file0[node,name] file1[node,name] ... } ... { file_n[node,name] file_n+1[node,name] ... }
+		{ [used bytes,count] file0[node,length,name length,name] file1[...] ... } ... { [used,count] file_n[...] ... }
+		records are packed from the front of each block and padded to 8 bytes; removing one closes the gap and pulls
+		records from the last block into the space, so only the last block is ever short by more than a record.
+		Directories with more than DIRHASH_MIN entries also keep an open addressing name index, mapped by a second
+		extent root in the extended node: { slot[name hash,block+1] ... } with a load factor of at most one half
 	
 	Block sizes were chosen to be 1024 bytes, as this is a common block size, is smaller than the page size, and is big enough to contain most small files
-	Names are given a fixed length to reduce complexity, and the length is such that a directory entry is 256 bytes
-		when/if a longer name is given, the name will be truncated to the fixed length
+	Names are stored at their own length, so a short name costs 16 or 24 bytes rather than a whole 256 byte entry;
+		when/if a name longer than NAMELEN-1 is given, it is truncated to that length. Older images' fixed entries
+		are repacked when the image is upgraded
 	The number of Inodes allocated to the filesystem is calculated so there are at least as many nodes as there
 		is space for the number of 4k files that can fit after the node table
 	Inodes store the same data for files as for directories, only sizes are interpreted differently,
 		and the mode is set appropriately to distinguish between them
-	No empty offset, data, or directory blocks are allocated, empty dirs and files of size 0 have 0 blocks
-	Free blocks are stored in a linked list and grouped into contiguous regions
+	No empty extent, data, or directory blocks are allocated, empty dirs and files of size 0 have 0 blocks
+	Files are sparse: growing a file or writing past its end leaves a hole that reads as zeros, and blocks are only
+		allocated under the bytes actually written
+	Files of at most INLINE_MAX bytes have no blocks at all: their data sits in the extent root of the extended node,
+		which they do not need for extents, and moves out to a block once the file grows past it. No space is set aside
+		for it, so the extended node is the same size for every file, inline or not
+	Allocated blocks are not cleared; each file keeps a valid mark past which it reads as zeros, so only the part of
+		a block in front of a write that starts past the mark is ever cleared
+	Since the image is mapped, write_buf needs no buffer of its own: writes read the request's pipe straight into
+		each contiguous stretch of a file's blocks, and memory buffers take the copying call instead. There is no
+		read_buf: FUSE frees every memory buffer one hands back and uses it after the file's lock is gone, so vectors
+		into the image cannot be returned, and copying into a buffer of its own would only be read with a malloc more.
+		FUSE falls back to read, which copies straight from the blocks into the request's buffer
+	Open files can get a handle slot in the meta region holding their node and the cursor where the last read or
+		write stopped; a remap of the file or reuse of the node invalidates the cursor or the handle
+	Images are validated, converted and upgraded only when a process first sees them at a given address; the mount
+		stamp in the spare room of the header's inode slot (the address and size mixed with the process's exec key,
+		worked out once per process) lets every other call skip that work with one load and compare, and is swapped
+		in with a compare and swap so that racing calls mount once. Each public call checks it once, in its wrapper,
+		and hands the meta header on to the stats and trace. The stamp and the descriptors handed to a mount are
+		cleared in every copy written to the backup-file
+	The meta header and extended inode table sit at the end of the image so older images can be converted in place:
+		on mount, the tail is taken from the free list and each inode's offset block chain is rewritten as extents
+	Names are hashed with 32 bit FNV-1a over the stored (truncated) name; a missing index is rebuilt on the fly, and when
+		there is no space for it the directory is simply scanned linearly
+	Path lookups go through a direct mapped cache keyed both by full path and by (parent node, name); removing or renaming
+		any entry drops its (parent, name) slot and bumps a generation that retires every full path entry at once.
+		Hit and miss counts are kept in the meta header and shown as dhits and dmisses in /.myfs-stats, to size the
+		cache by; names too long for a slot are not cached
+	Free inodes are chained through their extended nodes from a head kept in each allocation group, so creating a file
+		never scans the node table
+	Free blocks are tracked in a bitmap over the whole image, with a summary tree above it whose nodes hold the free run
+		at the start, at the end, and the longest anywhere below them, so a run of any length is found in one descent and
+		freed blocks are never written to. Older images have their free region list read into the bitmap on mount
+	The blocks are split into allocation groups of GROUP_BLOCKS, aligned so that each is one subtree of the summaries,
+		and the inodes into as many even ranges. A group has its own lock, free counts and free inode list, so writers in
+		different groups never touch the same lock or counter: new directories go to the group with the most free
+		blocks, files to their directory's group, and allocations without a block to follow start from a group picked
+		by thread. An allocation moves on through the other groups only once its own is full. Totals are summed from
+		the groups when statfs asks; the header's free count is left as it was before the bitmap
+	Blocks for a file are taken starting right after the block in front of them when that is free; a file growing at its
+		end also reserves the free run after its last block, sized like the file up to a cap, so interleaved writers do not
+		split each other's files. Reservations count as free space and are given back on truncate, close, or when an
+		allocation would otherwise fail
+	Unlinking a file only detaches its node onto an orphan list in the meta header, so removing a large file costs
+		nothing up front. The blocks are freed off the calls' path, when the image is flushed: a sync frees all of
+		them and a checkpoint a bounded step, and what is left resumes after a remount. Allocations that come up
+		short, and inode creation with no free nodes, reclaim everything at once.
+		Pending blocks count toward f_bfree but not f_bavail until they are actually freed
+	Calls can run on many threads at once. Every node has a reader/writer lock, shared by the nodes in the same one
+		of NODE_LOCKS stripes: reads, getattr, readdir and lseek hold it shared, writes, truncate and utimens exclusive,
+		and creating or removing an entry holds its directory (and the entry) exclusive. Path lookups hold one directory
+		at a time, shared, and hand back the generation of the node found, which is checked again once it is locked.
+		Nothing is looked up while a node lock is held; a call needing several nodes, as rename needs both directories
+		and the node moved, locks them all at once in ascending stripe order and checks its entry again before acting.
+		Below the node locks come the lookup cache and open file table locks, striped by slot (DCACHE_LOCKS and
+		OFILE_LOCKS) and never more than one held, then the orphan list lock, and last the group locks, of which no
+		call holds more than one. A reservation belongs to its node's lock holder, so
+		reclaiming them skips any node locked by someone else
+	Every block changed is marked in a dirty map: nodes when they are write locked or touched, and data, directory,
+		extent, index, bitmap and summary blocks where they are written. A flush holds every lock above the groups, writes the
+		marked runs to the backup-file in large sequential writes (or msyncs them for a shared mapping) and clears
+		them, so a sync costs what changed rather than the image size; a checkpoint mode does this every N seconds
+		from whichever call comes in first. The lookup cache, open files, locks and the maps themselves are rebuilt
+		on mount and never marked
+	Metadata is journaled: nodes, directory, extent and index blocks, the bitmap, its summaries, the groups and the
+		meta header are also marked in a journal map, and a flush to a backup-file first copies all of them into
+		a log slot as one batch (group commit) with a checksummed header listing their home blocks, then writes
+		and syncs that as a single sequential run before anything is written home. Mount copies a whole batch found
+		in the log back over its home blocks before reading anything else, so a crash mid-rename or mid-allocation
+		comes back as the state of the last commit; a torn batch fails its sum and the home blocks it stood for were
+		never touched. The log has two slots taken in turn, and the home writes of one batch are synced before the
+		next is written, so only the newer whole batch is ever replayed and the older is kept until the newer is
+		whole; checkpoints commit early once a batch reaches half a slot. File data is written home after the
+		commit, so after a crash a file may hold older contents than its size and blocks say, but its blocks are
+		always its own. A batch bigger than a slot, or a flush by msync where the kernel writes pages back whenever
+		it likes, is written in place without the journal, once both slots are struck out on disk so that a batch
+		left by an earlier flush cannot be replayed over it
+	Every entry point is a thin wrapper timing its body: the calls, errors, total time and a log2 histogram of
+		latencies of each operation, and counters for the hot helpers (path lookups and the components walked,
+		directory searches and the blocks scanned, block map walks and their length, blocks flushed and logged),
+		are kept with relaxed atomics in a stats region of the meta area, reset on mount and never written out.
+		The read-only file /.myfs-stats renders them as text on every getattr and read, with the lookup cache hits
+		and misses, so cat shows them; readdir does not list it and calls that would change it fail
+	The same wrappers can record a trace: with one started, every call is appended to the trace file as a fixed
+		record with its arguments, result and timing, followed by its paths, in a single write. The record, the
+		operation numbers and the format version are in myfs_trace.h, shared with fsreplay.c, which runs a
+		trace against a fresh or snapshotted image, as fast as it can or at the recorded pace, mapping the recorded
+		handles to its own, and reports per operation latencies and any call whose result differs from the trace
+	fsbench.c calls the implem functions in process on an anonymous mapping, flushing it to a backup-file of its own
+		when given one, so the logic here can be timed without FUSE; it runs create storm, sequential, random, deep
+		path and huge directory workloads and prints ops/s, bytes/s and latency percentiles per phase as JSON lines.
+		Its stress workload runs threads over the same few directories and files, checking for unexplained errors
+		and for leaked blocks or inodes once everything is removed, and is meant to be run under -fsanitize=thread
 	Testing was done similarly to HW3, using a separate file to test helper functions before working with FUSE
 	Valgrind was used to check for memory leaks and seemed to find none, though some were reported and appear to
 		result from FUSE
-	Certain functions were implemented inefficiently near the deadline and perfom noticably slowly under load,
-		notably frealloc, as used for truncates
+	Truncates collect every run past the new end, data and extent blocks alike, and free them in one sorted batch,
+		so cutting a file costs its extent count rather than its block count
 	The helper functions are implemented in the separate file myfs_helper.c, and filesystem types and definintions
 		are in myfs_helper.h
 	A makefile was made to build the project, with targets default(fuse version), debug(for gdb), and test(fstst.c)
@@ -756,6 +2983,15 @@ void fsinit(void *fsptr, size_t fssize)
 
 /* FUSE Function Implementations */
 
+int __myfs_openfh_implem(void *fsptr, size_t fssize, int *errnoptr,
+                         const char *path, uint64_t *fh);
+int __myfs_readfh_implem(void *fsptr, size_t fssize, int *errnoptr,
+                         const char *path, uint64_t fh, char *buf, size_t size, off_t off);
+int __myfs_writefh_implem(void *fsptr, size_t fssize, int *errnoptr,
+                          const char *path, uint64_t fh, const char *buf, size_t size, off_t off);
+int __myfs_writebuf_implem(void *fsptr, size_t fssize, int *errnoptr,
+                           const char *path, uint64_t fh, int fd, size_t size, off_t off);
+
 /* Implements an emulation of the stat system call on the filesystem 
    of size fssize pointed to by fsptr. 
    
@@ -782,33 +3018,45 @@ void fsinit(void *fsptr, size_t fssize)
    st_mtim
 
 */
-int __myfs_getattr_implem(void *fsptr, size_t fssize, int *errnoptr,
-                          uid_t uid, gid_t gid,
-                          const char *path, struct stat *stbuf) {
+int opgetattr(void *fsptr, size_t fssize, int *errnoptr,
+              uid_t uid, gid_t gid,
+              const char *path, struct stat *stbuf) {
 	fsheader *fshead=fsptr;
 	inode *nodetbl;
 	nodei node;
-	size_t unit=1;
 	
-	fsinit(fsptr,fssize);
 	nodetbl=(inode*)O2P(fshead->nodetbl);
 	
-	if((node=path2node(fsptr,path,NULL))==NONODE){
+	if((node=pathlock(fsptr,path,0))==NONODE){
 		*errnoptr=ENOENT;
 		return -1;
-	}if(nodetbl[node].mode==DIRMODE) unit=sizeof(direntry);
+	}
 	
 	stbuf->st_uid=uid;
 	stbuf->st_gid=gid;
 	stbuf->st_mode=nodetbl[node].mode;
-	stbuf->st_size=nodetbl[node].size*unit;
+	stbuf->st_size=(nodetbl[node].mode==DIRMODE)?nodetbl[node].nblocks*BLKSZ:nodetbl[node].size;
 	stbuf->st_nlink=nodetbl[node].nlinks;
-	stbuf->st_atim=nodetbl[node].atime;
+	stbuf->st_atim.tv_sec=__atomic_load_n(&nodetbl[node].atime.tv_sec,__ATOMIC_RELAXED);
+	stbuf->st_atim.tv_nsec=__atomic_load_n(&nodetbl[node].atime.tv_nsec,__ATOMIC_RELAXED);
 	stbuf->st_mtim=nodetbl[node].mtime;
 	stbuf->st_ctim=nodetbl[node].ctime;
+	nodeunlock(fsptr,node);
 	return 0;
 }
 
+int __myfs_getattr_implem(void *fsptr, size_t fssize, int *errnoptr,
+                          uid_t uid, gid_t gid,
+                          const char *path, struct stat *stbuf) {
+	uint64_t start=opstart();
+	fsmeta *meta=fsmount(fsptr,fssize);
+	int ret=(meta==NULL)?mountfail(errnoptr):isstats(path)?statsattr(fsptr,fssize,errnoptr,uid,gid,stbuf):
+		opgetattr(fsptr,fssize,errnoptr,uid,gid,path,stbuf);
+	
+	opend(fsptr,meta,OP_GETATTR,start,ret,errnoptr,path,NULL,0,0,0,0);
+	return ret;
+}
+
 /* Implements an emulation of the readdir system call on the filesystem 
    of size fssize pointed to by fsptr. 
 
@@ -845,51 +3093,65 @@ int __myfs_getattr_implem(void *fsptr, size_t fssize, int *errnoptr,
    indicated by returning -1 and setting *errnoptr to EINVAL.
 
 */
-int __myfs_readdir_implem(void *fsptr, size_t fssize, int *errnoptr,
-                          const char *path, char ***namesptr) {
+int opreaddir(void *fsptr, size_t fssize, int *errnoptr,
+              const char *path, char ***namesptr) {
 	fsheader *fshead=fsptr;
 	inode *nodetbl;
-	direntry *df;
+	dirblk *blk;
+	dirrec *rec;
 	nodei dir;
-	fpos pos;
-	struct timespec access;
+	sz_blk lblk;
 	size_t count=0;
 	char **namelist;
 	
-	fsinit(fsptr,fssize);
 	nodetbl=O2P(fshead->nodetbl);
 	
-	if((dir=path2node(fsptr,path,NULL))==NONODE){
+	if((dir=pathlock(fsptr,path,0))==NONODE){
 		*errnoptr=ENOENT;
 		return -1;
 	}if(nodetbl[dir].mode!=DIRMODE){
+		nodeunlock(fsptr,dir);
 		*errnoptr=ENOTDIR;
 		return -1;
-	}if((namelist=malloc(nodetbl[dir].size*sizeof(char*)))==NULL){
+	}
+	
+	touch(fsptr,dir);
+	if(nodetbl[dir].size==0){
+		nodeunlock(fsptr,dir);
+		return 0;
+	}if((namelist=calloc(nodetbl[dir].size,sizeof(char*)))==NULL){
+		nodeunlock(fsptr,dir);
 		*errnoptr=EINVAL;
 		return -1;
 	}
 	
-	timespec_get(&access,TIME_UTC);
-	nodetbl[dir].atime=access;
-	
-	loadpos(fsptr,&pos,dir);
-	while(pos.data!=NULLOFF){
-		df=(direntry*)B2P(pos.dblk);
-		if(df[pos.dpos].node==NONODE) break;
-		namelist[count]=(char*)malloc(strlen(df[pos.dpos].name));
-		if(namelist[count]==NULL){
-			while(count) free(namelist[--count]);
-			free(namelist);
-			*errnoptr=EINVAL;
-			return -1;
-		}strcpy(namelist[count],df[pos.dpos].name);
-		count++;
-		seek(fsptr,&pos,1);
-	}*namesptr=namelist;
+	for(lblk=0;lblk<nodetbl[dir].nblocks;lblk++){
+		blk=dirblkp(fsptr,dir,lblk);
+		for(rec=(dirrec*)(blk+1);(char*)rec<(char*)blk+blk->used && rec->len>0 && count<nodetbl[dir].size;rec=dirnext(rec)){
+			if((namelist[count]=(char*)malloc(rec->namelen+1))==NULL){
+				while(count) free(namelist[--count]);
+				free(namelist);
+				nodeunlock(fsptr,dir);
+				*errnoptr=EINVAL;
+				return -1;
+			}memcpy(namelist[count],rec->name,rec->namelen+1);
+			count++;
+		}
+	}nodeunlock(fsptr,dir);
+	*namesptr=namelist;
 	return count;
 }
 
+int __myfs_readdir_implem(void *fsptr, size_t fssize, int *errnoptr,
+                          const char *path, char ***namesptr) {
+	uint64_t start=opstart();
+	fsmeta *meta=fsmount(fsptr,fssize);
+	int ret=(meta==NULL)?mountfail(errnoptr):opreaddir(fsptr,fssize,errnoptr,path,namesptr);
+	
+	opend(fsptr,meta,OP_READDIR,start,ret,errnoptr,path,NULL,0,0,0,0);
+	return ret;
+}
+
 /* Implements an emulation of the mknod system call for regular files
    on the filesystem of size fssize pointed to by fsptr.
 
@@ -907,34 +3169,48 @@ int __myfs_readdir_implem(void *fsptr, size_t fssize, int *errnoptr,
    The error codes are documented in man 2 mknod.
 
 */
-int __myfs_mknod_implem(void *fsptr, size_t fssize, int *errnoptr, const char *path) {
+int opmknod(void *fsptr, size_t fssize, int *errnoptr, const char *path) {
 	fsheader *fshead=fsptr;
 	inode *nodetbl;
 	nodei pnode, node;
 	struct timespec creation;
 	const char *fname;
+	size_t gen;
 	
-	fsinit(fsptr,fssize);
 	nodetbl=(inode*)O2P(fshead->nodetbl);
 	
-	if((pnode=path2node(fsptr,path,&fname))==NONODE){
+	if((pnode=path2node(fsptr,path,&fname,&gen))==NONODE || nodelock(fsptr,pnode,gen,1)==-1){
 		*errnoptr=ENOENT;
 		return -1;
-	}if((node=newnode(fsptr))==NONODE){
+	}if((node=newnode(fsptr,nodegroup(fsptr,pnode)))==NONODE){
+		nodeunlock(fsptr,pnode);
 		*errnoptr=ENOSPC;
 		return -1;
-	}if(dirmod(fsptr,pnode,fname,node,NULL)==NONODE){
-		*errnoptr=EEXIST;
-		return -1;
 	}
 	
 	timespec_get(&creation,TIME_UTC);
 	nodetbl[node].mode=FILEMODE;
 	nodetbl[node].ctime=creation;
 	nodetbl[node].mtime=creation;
+	if(dirmod(fsptr,pnode,fname,node,NULL)==NONODE){
+		nodefree(fsptr,node);
+		nodeunlock(fsptr,pnode);
+		*errnoptr=EEXIST;
+		return -1;
+	}nodeunlock(fsptr,pnode);
 	return 0;
 }
 
+int __myfs_mknod_implem(void *fsptr, size_t fssize, int *errnoptr, const char *path) {
+	uint64_t start=opstart();
+	fsmeta *meta=fsmount(fsptr,fssize);
+	int ret=(meta==NULL)?mountfail(errnoptr):isstats(path)?statsdeny(errnoptr,EEXIST):
+		opmknod(fsptr,fssize,errnoptr,path);
+	
+	opend(fsptr,meta,OP_MKNOD,start,ret,errnoptr,path,NULL,0,0,0,0);
+	return ret;
+}
+
 /* Implements an emulation of the unlink system call for regular files
    on the filesystem of size fssize pointed to by fsptr.
 
@@ -947,24 +3223,34 @@ int __myfs_mknod_implem(void *fsptr, size_t fssize, int *errnoptr, const char *p
    The error codes are documented in man 2 unlink.
 
 */
-int __myfs_unlink_implem(void *fsptr, size_t fssize, int *errnoptr, const char *path) {
+int opunlink(void *fsptr, size_t fssize, int *errnoptr, const char *path) {
 	fsheader *fshead=fsptr;
 	inode *nodetbl;
-	nodei pnode, node;
+	nodei nodes[2], node;
 	const char *fname;
 	
-	fsinit(fsptr,fssize);
 	nodetbl=(inode*)O2P(fshead->nodetbl);
 	
-	if((pnode=path2node(fsptr,path,&fname))==NONODE){
+	if(entrylock(fsptr,path,nodes,&fname)==NONODE){
 		*errnoptr=ENOENT;
 		return -1;
-	}if((node=dirmod(fsptr,pnode,fname,0,""))==NONODE){
+	}if((node=dirmod(fsptr,nodes[0],fname,0,""))==NONODE){
+		nodesunlock(fsptr,nodes,2);
 		*errnoptr=EEXIST;
 		return -1;
-	}if(nodetbl[node].nlinks==0){
-		frealloc(fsptr,node,0);
-	}return 0;
+	}if(nodetbl[node].nlinks==0) nodeorphan(fsptr,node);
+	nodesunlock(fsptr,nodes,2);
+	return 0;
+}
+
+int __myfs_unlink_implem(void *fsptr, size_t fssize, int *errnoptr, const char *path) {
+	uint64_t start=opstart();
+	fsmeta *meta=fsmount(fsptr,fssize);
+	int ret=(meta==NULL)?mountfail(errnoptr):isstats(path)?statsdeny(errnoptr,EACCES):
+		opunlink(fsptr,fssize,errnoptr,path);
+	
+	opend(fsptr,meta,OP_UNLINK,start,ret,errnoptr,path,NULL,0,0,0,0);
+	return ret;
 }
 
 /* Implements an emulation of the rmdir system call on the filesystem 
@@ -982,19 +3268,34 @@ int __myfs_unlink_implem(void *fsptr, size_t fssize, int *errnoptr, const char *
    The error codes are documented in man 2 rmdir.
 
 */
-int __myfs_rmdir_implem(void *fsptr, size_t fssize, int *errnoptr, const char *path) {
-	nodei pnode;
+int oprmdir(void *fsptr, size_t fssize, int *errnoptr, const char *path) {
+	fsheader *fshead=fsptr;
+	inode *nodetbl;
+	nodei nodes[2], node;
 	const char *fname;
 	
-	fsinit(fsptr,fssize);
+	nodetbl=(inode*)O2P(fshead->nodetbl);
 	
-	if((pnode=path2node(fsptr,path,&fname))==NONODE){
+	if(entrylock(fsptr,path,nodes,&fname)==NONODE){
 		*errnoptr=ENOENT;
 		return -1;
-	}if(dirmod(fsptr,pnode,fname,0,"")==NONODE){
+	}if((node=dirmod(fsptr,nodes[0],fname,0,""))==NONODE){
+		nodesunlock(fsptr,nodes,2);
 		*errnoptr=EEXIST;
 		return -1;
-	}return 0;
+	}if(nodetbl[node].nlinks==0) nodeorphan(fsptr,node);
+	nodesunlock(fsptr,nodes,2);
+	return 0;
+}
+
+int __myfs_rmdir_implem(void *fsptr, size_t fssize, int *errnoptr, const char *path) {
+	uint64_t start=opstart();
+	fsmeta *meta=fsmount(fsptr,fssize);
+	int ret=(meta==NULL)?mountfail(errnoptr):isstats(path)?statsdeny(errnoptr,ENOTDIR):
+		oprmdir(fsptr,fssize,errnoptr,path);
+	
+	opend(fsptr,meta,OP_RMDIR,start,ret,errnoptr,path,NULL,0,0,0,0);
+	return ret;
 }
 
 /* Implements an emulation of the mkdir system call on the filesystem 
@@ -1009,34 +3310,48 @@ int __myfs_rmdir_implem(void *fsptr, size_t fssize, int *errnoptr, const char *p
    The error codes are documented in man 2 mkdir.
 
 */
-int __myfs_mkdir_implem(void *fsptr, size_t fssize, int *errnoptr, const char *path) {
+int opmkdir(void *fsptr, size_t fssize, int *errnoptr, const char *path) {
 	fsheader *fshead=fsptr;
 	inode *nodetbl;
 	struct timespec creation;
 	nodei pnode, node;
 	const char *fname;
+	size_t gen;
 	
-	fsinit(fsptr,fssize);
 	nodetbl=(inode*)O2P(fshead->nodetbl);
 
-	if((pnode=path2node(fsptr,path,&fname))==NONODE){
+	if((pnode=path2node(fsptr,path,&fname,&gen))==NONODE || nodelock(fsptr,pnode,gen,1)==-1){
 		*errnoptr=ENOENT;
 		return -1;
-	}if((node=newnode(fsptr))==NONODE){
+	}if((node=newnode(fsptr,dirgroup(fsptr)))==NONODE){
+		nodeunlock(fsptr,pnode);
 		*errnoptr=ENOSPC;
 		return -1;
-	}if(dirmod(fsptr,pnode,fname,node,NULL)==NONODE){
-		*errnoptr=EEXIST;
-		return -1;
 	}
 
 	timespec_get(&creation,TIME_UTC);
 	nodetbl[node].mode=DIRMODE;
 	nodetbl[node].ctime=creation;
 	nodetbl[node].mtime=creation;
+	if(dirmod(fsptr,pnode,fname,node,NULL)==NONODE){
+		nodefree(fsptr,node);
+		nodeunlock(fsptr,pnode);
+		*errnoptr=EEXIST;
+		return -1;
+	}nodeunlock(fsptr,pnode);
 	return 0;
 }
 
+int __myfs_mkdir_implem(void *fsptr, size_t fssize, int *errnoptr, const char *path) {
+	uint64_t start=opstart();
+	fsmeta *meta=fsmount(fsptr,fssize);
+	int ret=(meta==NULL)?mountfail(errnoptr):isstats(path)?statsdeny(errnoptr,EEXIST):
+		opmkdir(fsptr,fssize,errnoptr,path);
+	
+	opend(fsptr,meta,OP_MKDIR,start,ret,errnoptr,path,NULL,0,0,0,0);
+	return ret;
+}
+
 /* Implements an emulation of the rename system call on the filesystem 
    of size fssize pointed to by fsptr. 
 
@@ -1053,24 +3368,35 @@ int __myfs_mkdir_implem(void *fsptr, size_t fssize, int *errnoptr, const char *p
    The error codes are documented in man 2 rename.
 
 */
-int __myfs_rename_implem(void *fsptr, size_t fssize, int *errnoptr,
-                         const char *from, const char *to) {
+int oprename(void *fsptr, size_t fssize, int *errnoptr,
+             const char *from, const char *to) {
 	fsheader *fshead=fsptr;
 	inode *nodetbl;
-	nodei pfrom, pto, file;
+	nodei nodes[3], pfrom, pto, file;
 	struct timespec modify;
 	const char *ffrom, *fto;
+	size_t gens[3];
 	
-	fsinit(fsptr,fssize);
 	nodetbl=(inode*)O2P(fshead->nodetbl);
 	
-	if((pfrom=path2node(fsptr,from,&ffrom))==NONODE){
+	if((pfrom=path2node(fsptr,from,&ffrom,&gens[0]))==NONODE || (file=path2node(fsptr,from,NULL,&gens[1]))==NONODE){
+		*errnoptr=ENOENT;
+		return -1;
+	}if((pto=path2node(fsptr,to,&fto,&gens[2]))==NONODE){
 		*errnoptr=ENOENT;
 		return -1;
-	}if((pto=path2node(fsptr,to,&fto))==NONODE){
+	}
+	
+	//Both directories and the node moved are locked at once in stripe order, so renames crossing each other's
+	//directories cannot deadlock; the source entry is checked again under the locks, as the lookups held none
+	nodes[0]=pfrom;
+	nodes[1]=file;
+	nodes[2]=pto;
+	if(nodeslock(fsptr,nodes,gens,3)==-1){
 		*errnoptr=ENOENT;
 		return -1;
-	}if((file=dirmod(fsptr,pfrom,ffrom,NONODE,NULL))==NONODE){
+	}if(dirmod(fsptr,pfrom,ffrom,NONODE,NULL)!=file){
+		nodesunlock(fsptr,nodes,3);
 		*errnoptr=ENOENT;
 		return -1;
 	}
@@ -1080,19 +3406,35 @@ int __myfs_rename_implem(void *fsptr, size_t fssize, int *errnoptr,
 	
 	if(pto==pfrom){
 		if(dirmod(fsptr,pfrom,ffrom,NONODE,fto)==NONODE){
+			nodesunlock(fsptr,nodes,3);
 			*errnoptr=EEXIST;
 			return -1;
-		}return 0;
+		}nodesunlock(fsptr,nodes,3);
+		return 0;
 	}
 	
 	if(dirmod(fsptr,pto,fto,file,NULL)==NONODE){
+		nodesunlock(fsptr,nodes,3);
 		*errnoptr=EEXIST;
 		return -1;
 	}if(dirmod(fsptr,pfrom,ffrom,0,"")==NONODE){
 		dirmod(fsptr,pto,fto,0,"");
+		nodesunlock(fsptr,nodes,3);
 		*errnoptr=EACCES;
 		return -1;
-	}return 0;
+	}nodesunlock(fsptr,nodes,3);
+	return 0;
+}
+
+int __myfs_rename_implem(void *fsptr, size_t fssize, int *errnoptr,
+                         const char *from, const char *to) {
+	uint64_t start=opstart();
+	fsmeta *meta=fsmount(fsptr,fssize);
+	int ret=(meta==NULL)?mountfail(errnoptr):(isstats(from) || isstats(to))?statsdeny(errnoptr,EACCES):
+		oprename(fsptr,fssize,errnoptr,from,to);
+	
+	opend(fsptr,meta,OP_RENAME,start,ret,errnoptr,from,to,0,0,0,0);
+	return ret;
 }
 
 /* Implements an emulation of the truncate system call on the filesystem 
@@ -1111,20 +3453,20 @@ int __myfs_rename_implem(void *fsptr, size_t fssize, int *errnoptr,
    The error codes are documented in man 2 truncate.
 
 */
-int __myfs_truncate_implem(void *fsptr, size_t fssize, int *errnoptr,
-                           const char *path, off_t offset) {
+int optruncate(void *fsptr, size_t fssize, int *errnoptr,
+               const char *path, off_t offset) {
 	fsheader *fshead=fsptr;
 	inode *nodetbl;
 	nodei node;
 	struct timespec modify;
 	
-	fsinit(fsptr,fssize);
 	nodetbl=(inode*)O2P(fshead->nodetbl);
 	
-	if((node=path2node(fsptr,path,NULL))==NONODE){
+	if((node=pathlock(fsptr,path,1))==NONODE){
 		*errnoptr=ENOENT;
 		return -1;
 	}if(nodetbl[node].mode!=FILEMODE){
+		nodeunlock(fsptr,node);
 		*errnoptr=EISDIR;
 		return -1;
 	}
@@ -1133,9 +3475,22 @@ int __myfs_truncate_implem(void *fsptr, size_t fssize, int *errnoptr,
 	nodetbl[node].mtime=modify;
 	
 	if(frealloc(fsptr,node,offset)==-1){
+		nodeunlock(fsptr,node);
 		*errnoptr=EPERM;
 		return -1;
-	}return 0;
+	}nodeunlock(fsptr,node);
+	return 0;
+}
+
+int __myfs_truncate_implem(void *fsptr, size_t fssize, int *errnoptr,
+                           const char *path, off_t offset) {
+	uint64_t start=opstart();
+	fsmeta *meta=fsmount(fsptr,fssize);
+	int ret=(meta==NULL)?mountfail(errnoptr):isstats(path)?statsdeny(errnoptr,EACCES):
+		optruncate(fsptr,fssize,errnoptr,path,offset);
+	
+	opend(fsptr,meta,OP_TRUNCATE,start,ret,errnoptr,path,NULL,0,offset,0,0);
+	return ret;
 }
 
 /* Implements an emulation of the open system call on the filesystem 
@@ -1165,24 +3520,78 @@ int __myfs_truncate_implem(void *fsptr, size_t fssize, int *errnoptr,
 
 */
 int __myfs_open_implem(void *fsptr, size_t fssize, int *errnoptr, const char *path) {
+	return __myfs_openfh_implem(fsptr,fssize,errnoptr,path,NULL);
+}
+
+/* Same as __myfs_open_implem, but when fh is not NULL and path is a
+   regular file, a handle for it is put into *fh (FUSE's fi->fh). The
+   handle remembers the inode and where the last read or write through
+   it stopped, so sequential I/O does not resolve the path or look up
+   the block map again.
+
+   *fh is set to 0 when no handle could be given out (directories, or
+   every handle slot in use); calls taking a handle fall back to the
+   path for it.
+
+*/
+int opopenfh(void *fsptr, size_t fssize, int *errnoptr,
+             const char *path, uint64_t *fh) {
 	fsheader *fshead=fsptr;
 	inode *nodetbl;
 	nodei node;
-	struct timespec access;
 	
-	fsinit(fsptr,fssize);
 	nodetbl=(inode*)O2P(fshead->nodetbl);
 	
-	if((node=path2node(fsptr,path,NULL))==NONODE){
+	if((node=pathlock(fsptr,path,0))==NONODE){
 		*errnoptr=ENOENT;
 		return -1;
+	}if(fh!=NULL){
+		*fh=(nodetbl[node].mode==FILEMODE)?ofopen(fsptr,node):0;
 	}
 	
-	timespec_get(&access,TIME_UTC);
-	nodetbl[node].atime=access;
+	touch(fsptr,node);
+	nodeunlock(fsptr,node);
+	return 0;
+}
+
+int __myfs_openfh_implem(void *fsptr, size_t fssize, int *errnoptr,
+                         const char *path, uint64_t *fh) {
+	uint64_t start=opstart();
+	fsmeta *meta=fsmount(fsptr,fssize);
+	int ret=0;
+	
+	if(meta==NULL) ret=mountfail(errnoptr);
+	else if(!isstats(path)) ret=opopenfh(fsptr,fssize,errnoptr,path,fh);
+	else if(fh!=NULL) *fh=0;
+	opend(fsptr,meta,OP_OPEN,start,ret,errnoptr,path,NULL,(fh!=NULL)?*fh:0,0,0,fh!=NULL);
+	return ret;
+}
+
+/* Releases a handle given out by __myfs_openfh_implem. Releasing
+   handle 0, or one that was already released, does nothing.
+
+   On success, 0 is returned.
+
+*/
+int oprelease(void *fsptr, size_t fssize, int *errnoptr, uint64_t fh) {
+	ofile of;
+	
+	if(ofget(fsptr,fh,&of)==0 && nodelock(fsptr,of.node,of.gen,1)==0){
+		resvdrop(fsptr,of.node);
+		nodeunlock(fsptr,of.node);
+	}ofclose(fsptr,fh);
 	return 0;
 }
 
+int __myfs_release_implem(void *fsptr, size_t fssize, int *errnoptr, uint64_t fh) {
+	uint64_t start=opstart();
+	fsmeta *meta=fsmount(fsptr,fssize);
+	int ret=(meta==NULL)?mountfail(errnoptr):oprelease(fsptr,fssize,errnoptr,fh);
+	
+	opend(fsptr,meta,OP_RELEASE,start,ret,errnoptr,NULL,NULL,fh,0,0,0);
+	return ret;
+}
+
 /* Implements an emulation of the read system call on the filesystem 
    of size fssize pointed to by fsptr.
 
@@ -1200,51 +3609,57 @@ int __myfs_open_implem(void *fsptr, size_t fssize, int *errnoptr, const char *pa
 */
 int __myfs_read_implem(void *fsptr, size_t fssize, int *errnoptr,
                        const char *path, char *buf, size_t size, off_t off) {
+	return __myfs_readfh_implem(fsptr,fssize,errnoptr,path,0,buf,size,off);
+}
 
+/* Same as __myfs_read_implem, reading through the handle fh when it
+   is still valid and through path otherwise.
 
+*/
+int opreadfh(void *fsptr, size_t fssize, int *errnoptr,
+             const char *path, uint64_t fh, char *buf, size_t size, off_t off) {
+	fsheader *fshead=fsptr;
+	inode *nodetbl;
+	ofile of;
+	nodei node;
+	int ret;
+	
+	nodetbl=(inode*)O2P(fshead->nodetbl);
+	
+	if((node=fhlock(fsptr,path,&fh,&of,0))==NONODE){
+		*errnoptr=ENOENT;
+		return -1;
+	}if(nodetbl[node].mode!=FILEMODE){
+		nodeunlock(fsptr,node);
+		*errnoptr=EISDIR;
+		return -1;
+	}if(off<0){
+		nodeunlock(fsptr,node);
+		*errnoptr=EINVAL;
+		return -1;
+	}if(size==0){
+		nodeunlock(fsptr,node);
+		return 0;
+	}
+	
+	touch(fsptr,node);
+	
+	if(fh!=0) ofseek(fsptr,&of,off);
+	ret=copyrun(fsptr,node,buf,size,off,0,(fh!=0)?&of.pos:NULL);
+	nodeunlock(fsptr,node);
+	if(fh!=0) ofput(fsptr,fh,&of);
+	return ret;
+}
 
-   fsheader *fshead=fsptr;
-   inode *nodetbl;
-   nodei node;
-   fpos pos;
-   size_t readct=0, nblks;
-   struct timespec access;
-   
-   fsinit(fsptr,fssize);
-   nodetbl=(inode*)O2P(fshead->nodetbl);
-   
-   if((node=path2node(fsptr,path,NULL))==NONODE){
-      *errnoptr=ENOENT;
-      return -1;
-   }if(nodetbl[node].mode!=FILEMODE){
-      *errnoptr=EISDIR;
-      return -1;
-   }if(size==0) return 0;
-
-   timespec_get(&access,TIME_UTC);
-   nodetbl[node].atime=access;
-   
-   loadpos(fsptr,&pos,node);
-   seek(fsptr,&pos,off);
-   while(pos.data!=NULLOFF && readct<size){
-      char* blk=B2P(pos.dblk);
-      buf[readct++]=blk[pos.dpos];
-      seek(fsptr,&pos,1);
-   }
-   while(readct<size){
-      loadpos(fsptr,&pos,node);
-      seek(fsptr,&pos,off+readct);
-      char* blk=B2P(pos.dblk);
-      buf[readct++]=blk[pos.dpos];
-      seek(fsptr,&pos,1);
-   }
-
-
-
-
-   return readct;
-
-  return -1;
+int __myfs_readfh_implem(void *fsptr, size_t fssize, int *errnoptr,
+                         const char *path, uint64_t fh, char *buf, size_t size, off_t off) {
+	uint64_t start=opstart();
+	fsmeta *meta=fsmount(fsptr,fssize);
+	int ret=(meta==NULL)?mountfail(errnoptr):isstats(path)?statsread(fsptr,fssize,errnoptr,buf,size,off):
+		opreadfh(fsptr,fssize,errnoptr,path,fh,buf,size,off);
+	
+	opend(fsptr,meta,OP_READ,start,ret,errnoptr,path,NULL,fh,off,size,0);
+	return ret;
 }
 
 /* Implements an emulation of the write system call on the filesystem 
@@ -1264,50 +3679,254 @@ int __myfs_read_implem(void *fsptr, size_t fssize, int *errnoptr,
 */
 int __myfs_write_implem(void *fsptr, size_t fssize, int *errnoptr,
                         const char *path, const char *buf, size_t size, off_t off) {
+	return __myfs_writefh_implem(fsptr,fssize,errnoptr,path,0,buf,size,off);
+}
+
+/* Same as __myfs_write_implem, writing through the handle fh when it
+   is still valid and through path otherwise.
+
+*/
+int opwritefh(void *fsptr, size_t fssize, int *errnoptr,
+              const char *path, uint64_t fh, const char *buf, size_t size, off_t off) {
 	fsheader *fshead=fsptr;
 	inode *nodetbl;
+	ofile of;
 	nodei node;
-	fpos pos;
 	struct timespec modify;
-	size_t writect=0;
+	size_t oldsize;
+	int ret;
 	
-	fsinit(fsptr,fssize);
 	nodetbl=(inode*)O2P(fshead->nodetbl);
 	
-	if((node=path2node(fsptr,path,NULL))==NONODE){
+	if((node=fhlock(fsptr,path,&fh,&of,1))==NONODE){
 		*errnoptr=ENOENT;
 		return -1;
 	}if(nodetbl[node].mode!=FILEMODE){
+		nodeunlock(fsptr,node);
 		*errnoptr=EISDIR;
 		return -1;
-	}
-	
+	}if(off<0){
+		nodeunlock(fsptr,node);
+		*errnoptr=EINVAL;
+		return -1;
+	}if(size==0){
+		nodeunlock(fsptr,node);
+		return 0;
+	}oldsize=nodetbl[node].size;
+	if(off+size>oldsize && frealloc(fsptr,node,off+size)==-1){
+		nodeunlock(fsptr,node);
+		*errnoptr=ENOSPC;
+		return -1;
+	}if(blkfill(fsptr,node,off,size)==-1){
+		frealloc(fsptr,node,oldsize);
+		nodeunlock(fsptr,node);
+		*errnoptr=ENOSPC;
+		return -1;
+	}if(fh!=0) ofseek(fsptr,&of,off);
+	ret=copyrun(fsptr,node,(char*)buf,size,off,1,(fh!=0)?&of.pos:NULL);
 	timespec_get(&modify,TIME_UTC);
 	nodetbl[node].mtime=modify;
+	nodeunlock(fsptr,node);
+	if(fh!=0) ofput(fsptr,fh,&of);
+	return ret;
+}
+
+int __myfs_writefh_implem(void *fsptr, size_t fssize, int *errnoptr,
+                          const char *path, uint64_t fh, const char *buf, size_t size, off_t off) {
+	uint64_t start=opstart();
+	fsmeta *meta=fsmount(fsptr,fssize);
+	int ret=(meta==NULL)?mountfail(errnoptr):isstats(path)?statsdeny(errnoptr,EACCES):
+		opwritefh(fsptr,fssize,errnoptr,path,fh,buf,size,off);
+	
+	opend(fsptr,meta,OP_WRITE,start,ret,errnoptr,path,NULL,fh,off,size,0);
+	return ret;
+}
+
+/* Same as __myfs_writefh_implem, but the data is read from the file
+   descriptor fd straight into the file's blocks, with no buffer in
+   between; FUSE's write_buf passes the pipe it spliced the request
+   into, and writes from memory go through __myfs_writefh_implem.
+
+   Only as much as fd reports holding through FIONREAD is written, which
+   pipes, sockets and regular files all support, so the blocks mapped
+   for the write are always filled. Should fd still come up short or
+   fail, the holes mapped for the rest of the range are cleared rather
+   than left showing whatever the new blocks held, the bytes that were
+   there before are left as they were, and the file only grows as far
+   as was written.
+
+   On success, the number of bytes written is returned.
+
+   On failure, -1 is returned and *errnoptr is set as for write, or to
+   the error fd gave if nothing could be read from it.
+
+*/
+int opwritebuf(void *fsptr, size_t fssize, int *errnoptr,
+               const char *path, uint64_t fh, int fd, size_t size, off_t off) {
+	fsheader *fshead=fsptr;
+	inode *nodetbl;
+	xinode *xn;
+	ofile of;
+	nodei node;
+	struct timespec modify;
+	struct iovec iov[IOVS_MAX];
+	size_t oldsize, done, mapped, end;
+	ssize_t got=0;
+	sz_blk first=0, lblk, run;
+	char *holes=NULL;
+	int count, avail;
+	
+	if(ioctl(fd,FIONREAD,&avail)==-1){
+		*errnoptr=errno;
+		return -1;
+	}nodetbl=(inode*)O2P(fshead->nodetbl);
+	size=MIN(size,(size_t)avail);
+	
+	if((node=fhlock(fsptr,path,&fh,&of,1))==NONODE){
+		*errnoptr=ENOENT;
+		return -1;
+	}if(nodetbl[node].mode!=FILEMODE){
+		nodeunlock(fsptr,node);
+		*errnoptr=EISDIR;
+		return -1;
+	}if(off<0){
+		nodeunlock(fsptr,node);
+		*errnoptr=EINVAL;
+		return -1;
+	}if(size==0){
+		nodeunlock(fsptr,node);
+		return 0;
+	}oldsize=nodetbl[node].size;
+	end=MIN(off+size,oldsize);
+	if(off+size>oldsize && frealloc(fsptr,node,off+size)==-1){
+		nodeunlock(fsptr,node);
+		*errnoptr=ENOSPC;
+		return -1;
+	}
 	
-	if(size==0) return 0;	
-	if(off>=nodetbl[node].size){
-		size_t offsize=MIN(((off+BLKSZ-1)/BLKSZ)*BLKSZ,(off+size));
-		if(frealloc(fsptr,node,MIN(offsize,(off+size)))==-1){
+	//The pipe may fail part way, after blkfill has mapped the holes under the old size to blocks holding anything;
+	//those, and only those, are cleared again then, so a failed write leaves every byte that was there alone
+	if(nodetbl[node].nblocks>0 && (size_t)off<end){
+		first=off/BLKSZ;
+		if((holes=calloc(CLDIV(end,BLKSZ)-first,1))==NULL){
+			frealloc(fsptr,node,oldsize);
+			nodeunlock(fsptr,node);
 			*errnoptr=EINVAL;
 			return -1;
+		}for(lblk=first;lblk<CLDIV(end,BLKSZ);lblk+=run){
+			if(bmap(fsptr,node,lblk,&run)==NULLOFF) memset(holes+lblk-first,1,MIN(run,CLDIV(end,BLKSZ)-lblk));
 		}
-	}loadpos(fsptr,&pos,node);
-	seek(fsptr,&pos,off);
-	while(pos.data!=NULLOFF && writect<size){
-		char* blk=B2P(pos.dblk);
-		blk[pos.dpos]=buf[writect++];
-		seek(fsptr,&pos,1);
-	}while(writect<size){
-		if(pos.data==NULLOFF){
-			size_t extsize=MIN((off+size),(nodetbl[node].nblocks+1)*BLKSZ);
-			if(frealloc(fsptr,node,extsize)==-1) break;
-		}loadpos(fsptr,&pos,node);
-		seek(fsptr,&pos,off+writect);
-		char* blk=B2P(pos.dblk);
-		blk[pos.dpos]=buf[writect++];
-		seek(fsptr,&pos,1);
-	}return writect;
+	}if(blkfill(fsptr,node,off,size)==-1){
+		free(holes);
+		frealloc(fsptr,node,oldsize);
+		nodeunlock(fsptr,node);
+		*errnoptr=ENOSPC;
+		return -1;
+	}xn=&xnodes(fsptr)[node];
+	if(nodetbl[node].nblocks>0 && (size_t)off>xn->valid) copyrun(fsptr,node,NULL,off-xn->valid,xn->valid,1,NULL);
+	
+	for(done=0;done<size;done+=got){
+		count=IOVS_MAX;
+		if((mapped=iovmap(fsptr,node,iov,&count,size-done,off+done))==0) break;
+		if((got=readv(fd,iov,count))<=0) break;
+		if(nodetbl[node].nblocks>0 && off+done+got>xn->valid) xn->valid=off+done+got;
+		if((size_t)got<mapped){
+			done+=got;
+			break;
+		}
+	}for(lblk=(off+done)/BLKSZ;holes!=NULL && done<size && lblk*BLKSZ<end;lblk++){
+		if(!holes[lblk-first]) continue;
+		mapped=(lblk*BLKSZ>off+done)?lblk*BLKSZ:off+done;
+		copyrun(fsptr,node,NULL,MIN((lblk+1)*BLKSZ,end)-mapped,mapped,1,NULL);
+	}free(holes);
+	if(done<size && off+size>oldsize) frealloc(fsptr,node,(off+done>oldsize)?off+done:oldsize);
+	if(done>0){
+		timespec_get(&modify,TIME_UTC);
+		nodetbl[node].mtime=modify;
+	}nodeunlock(fsptr,node);
+	if(done==0 && got<0){
+		*errnoptr=errno;
+		return -1;
+	}return done;
+}
+
+int __myfs_writebuf_implem(void *fsptr, size_t fssize, int *errnoptr,
+                           const char *path, uint64_t fh, int fd, size_t size, off_t off) {
+	uint64_t start=opstart();
+	fsmeta *meta=fsmount(fsptr,fssize);
+	int ret=(meta==NULL)?mountfail(errnoptr):isstats(path)?statsdeny(errnoptr,EACCES):
+		opwritebuf(fsptr,fssize,errnoptr,path,fh,fd,size,off);
+	
+	opend(fsptr,meta,OP_WRITEBUF,start,ret,errnoptr,path,NULL,fh,off,size,0);
+	return ret;
+}
+
+/* Implements an emulation of the lseek system call on the filesystem 
+   of size fssize pointed to by fsptr, for the SEEK_DATA and SEEK_HOLE
+   whences that FUSE passes down (the others are handled by the kernel).
+
+   SEEK_DATA returns the first offset at or after off that lies in an
+   allocated block, SEEK_HOLE the first one that lies in a hole, where
+   the end of the file counts as a hole.
+
+   On success, the new offset is returned.
+
+   On failure, -1 is returned and *errnoptr is set appropriately.
+
+   The error codes are documented in man 2 lseek.
+
+*/
+off_t oplseek(void *fsptr, size_t fssize, int *errnoptr,
+              const char *path, off_t off, int whence) {
+	fsheader *fshead=fsptr;
+	inode *nodetbl;
+	nodei node;
+	sz_blk lblk, run;
+	blkset dblk;
+	off_t pos=-1;
+	
+	nodetbl=(inode*)O2P(fshead->nodetbl);
+	
+	if((node=pathlock(fsptr,path,0))==NONODE){
+		*errnoptr=ENOENT;
+		return -1;
+	}if(nodetbl[node].mode!=FILEMODE){
+		nodeunlock(fsptr,node);
+		*errnoptr=EISDIR;
+		return -1;
+	}if(whence!=SEEK_DATA && whence!=SEEK_HOLE){
+		nodeunlock(fsptr,node);
+		*errnoptr=EINVAL;
+		return -1;
+	}if(off<0 || (size_t)off>=nodetbl[node].size){
+		nodeunlock(fsptr,node);
+		*errnoptr=ENXIO;
+		return -1;
+	}if(nodetbl[node].nblocks==0){
+		pos=(whence==SEEK_DATA)?off:(off_t)nodetbl[node].size;
+		nodeunlock(fsptr,node);
+		return pos;
+	}
+	
+	for(lblk=off/BLKSZ;lblk<nodetbl[node].nblocks && pos==-1;lblk+=run){
+		dblk=bmap(fsptr,node,lblk,&run);
+		if((dblk!=NULLOFF)==(whence==SEEK_DATA)){
+			pos=MIN(nodetbl[node].size,(off>(off_t)(lblk*BLKSZ))?(size_t)off:lblk*BLKSZ);
+		}
+	}if(pos==-1 && whence==SEEK_HOLE) pos=nodetbl[node].size;
+	nodeunlock(fsptr,node);
+	if(pos==-1) *errnoptr=ENXIO;
+	return pos;
+}
+
+off_t __myfs_lseek_implem(void *fsptr, size_t fssize, int *errnoptr,
+                          const char *path, off_t off, int whence) {
+	uint64_t start=opstart();
+	fsmeta *meta=fsmount(fsptr,fssize);
+	off_t ret=(meta==NULL)?mountfail(errnoptr):oplseek(fsptr,fssize,errnoptr,path,off,whence);
+	
+	opend(fsptr,meta,OP_LSEEK,start,ret,errnoptr,path,NULL,0,off,0,whence);
+	return ret;
 }
 
 /* Implements an emulation of the utimensat system call on the filesystem 
@@ -1323,25 +3942,36 @@ int __myfs_write_implem(void *fsptr, size_t fssize, int *errnoptr,
    The error codes are documented in man 2 utimensat.
 
 */
-int __myfs_utimens_implem(void *fsptr, size_t fssize, int *errnoptr,
-                          const char *path, const struct timespec ts[2]) {
+int oputimens(void *fsptr, size_t fssize, int *errnoptr,
+              const char *path, const struct timespec ts[2]) {
 	fsheader *fshead=fsptr;
 	inode *nodetbl;
 	nodei node;
 	
-	fsinit(fsptr,fssize);
 	nodetbl=(inode*)O2P(fshead->nodetbl);
 	
-	if((node=path2node(fsptr,path,NULL))==NONODE){
+	if((node=pathlock(fsptr,path,1))==NONODE){
 		*errnoptr=ENOENT;
 		return -1;
 	}
 	
 	nodetbl[node].atime=ts[0];
 	nodetbl[node].mtime=ts[1];
+	nodeunlock(fsptr,node);
 	return 0;
 }
 
+int __myfs_utimens_implem(void *fsptr, size_t fssize, int *errnoptr,
+                          const char *path, const struct timespec ts[2]) {
+	uint64_t start=opstart();
+	fsmeta *meta=fsmount(fsptr,fssize);
+	int ret=(meta==NULL)?mountfail(errnoptr):isstats(path)?statsdeny(errnoptr,EACCES):
+		oputimens(fsptr,fssize,errnoptr,path,ts);
+	
+	opend(fsptr,meta,OP_UTIMENS,start,ret,errnoptr,path,NULL,(uint64_t)ts[0].tv_nsec<<32|ts[1].tv_nsec,ts[0].tv_sec,ts[1].tv_sec,0);
+	return ret;
+}
+
 /* Implements an emulation of the statfs system call on the filesystem 
    of size fssize pointed to by fsptr.
 
@@ -1365,16 +3995,133 @@ int __myfs_utimens_implem(void *fsptr, size_t fssize, int *errnoptr,
              filesystem has such a maximum
 
 */
-int __myfs_statfs_implem(void *fsptr, size_t fssize, int *errnoptr,
-                         struct statvfs* stbuf) {
+int opstatfs(void *fsptr, size_t fssize, int *errnoptr,
+             struct statvfs* stbuf) {
 	fsheader *fshead=fsptr;
+	fsmeta *meta;
+	sz_blk blks, reserved, pending;
+	size_t nodes;
 	
-	fsinit(fsptr,fssize);
+	meta=getmeta(fsptr);
 	
+	groupsum(fsptr,&blks,&reserved,&nodes);
+	pthread_mutex_lock(&getlocks(fsptr)->orphans);
+	pending=meta->pending;
+	pthread_mutex_unlock(&getlocks(fsptr)->orphans);
 	stbuf->f_bsize=BLKSZ;
 	stbuf->f_blocks=fshead->size;
-	stbuf->f_bfree=fshead->free;
-	stbuf->f_bavail=fshead->free;
+	stbuf->f_bfree=blks+reserved+pending;
+	stbuf->f_bavail=blks+reserved;
+	stbuf->f_files=fshead->ntsize*NODES_BLOCK-1;
+	stbuf->f_ffree=nodes;
+	stbuf->f_favail=nodes;
 	stbuf->f_namemax=NAMELEN-1;
 	return 0;
 }
+
+int __myfs_statfs_implem(void *fsptr, size_t fssize, int *errnoptr,
+                         struct statvfs* stbuf) {
+	uint64_t start=opstart();
+	fsmeta *meta=fsmount(fsptr,fssize);
+	int ret=(meta==NULL)?mountfail(errnoptr):opstatfs(fsptr,fssize,errnoptr,stbuf);
+	
+	opend(fsptr,meta,OP_STATFS,start,ret,errnoptr,NULL,NULL,0,0,0,0);
+	return ret;
+}
+
+/* Writes every block changed since the last flush back to the
+   backup-file open as fd, each at its own offset in the image, so that
+   a sync or unmount only costs what changed. Changed metadata is
+   committed to the log in the image first, so a crash during the
+   flush is recovered at the next mount. With fd of -1 the image is
+   taken to be a shared mapping of the backup-file, and the changed
+   ranges are synced in place with msync instead. Other calls wait while
+   the flush runs.
+
+   On success, the number of blocks written is returned.
+
+   On failure, -1 is returned and *errnoptr is set to the error the
+   write, msync or fdatasync gave; whatever was not written is kept for
+   the next flush.
+
+*/
+int opflush(void *fsptr, size_t fssize, int *errnoptr, int fd) {
+	sz_blk written;
+	
+	if(fsflush(fsptr,fd,1,&written)==-1){
+		*errnoptr=errno;
+		return -1;
+	}return MIN(written,INT_MAX);
+}
+
+int __myfs_flush_implem(void *fsptr, size_t fssize, int *errnoptr, int fd) {
+	uint64_t start=opstart();
+	fsmeta *meta=fsmount(fsptr,fssize);
+	int ret=(meta==NULL)?mountfail(errnoptr):opflush(fsptr,fssize,errnoptr,fd);
+	
+	opend(fsptr,meta,OP_FLUSH,start,ret,errnoptr,NULL,NULL,0,0,0,0);
+	return ret;
+}
+
+/* Checkpoints the filesystem every interval seconds: the first call
+   made once the interval is up, or once the metadata changed would
+   fill half a log slot, commits it to fd first. A checkpoint only waits
+   for the log to reach the disk; the blocks written home after it are
+   synced before the next one. An interval of 0 turns checkpoints
+   off, and they are always off after a mount.
+
+   On success, 0 is returned.
+
+*/
+int opcheckpoint(void *fsptr, size_t fssize, int *errnoptr, int fd, unsigned interval) {
+	struct timespec now;
+	fsmeta *meta;
+	
+	meta=getmeta(fsptr);
+	
+	timespec_get(&now,TIME_UTC);
+	__atomic_store_n(&meta->mnt.ckint,0,__ATOMIC_RELAXED);
+	__atomic_store_n(&meta->mnt.ckfd,fd,__ATOMIC_RELAXED);
+	__atomic_store_n(&meta->mnt.cknext,now.tv_sec+interval,__ATOMIC_RELAXED);
+	__atomic_store_n(&meta->mnt.ckint,interval,__ATOMIC_RELEASE);
+	return 0;
+}
+
+int __myfs_checkpoint_implem(void *fsptr, size_t fssize, int *errnoptr, int fd, unsigned interval) {
+	uint64_t start=opstart();
+	fsmeta *meta=fsmount(fsptr,fssize);
+	int ret=(meta==NULL)?mountfail(errnoptr):opcheckpoint(fsptr,fssize,errnoptr,fd,interval);
+	
+	opend(fsptr,meta,OP_CHECKPOINT,start,ret,errnoptr,NULL,NULL,0,0,0,interval);
+	return ret;
+}
+
+/* Starts recording every call made into the filesystem to fd, which
+   should be a new, empty file, or stops it when fd is -1. The trace
+   starts with a trhead naming its format version, and each call
+   is written as it returns, as a trrec giving its operation, result,
+   handle, offset, size, start time since the trace began and how
+   long it took, followed by its paths; fsreplay.c plays a trace
+   back. Tracing is always off after a mount.
+
+   On success, 0 is returned. On failure, -1 is returned and
+   *errnoptr is set to the error writing the trace header gave.
+
+*/
+int __myfs_trace_implem(void *fsptr, size_t fssize, int *errnoptr, int fd) {
+	trhead head={TRACE_MAGIC,TRACE_VERSION,sizeof(trrec)};
+	fsmeta *meta;
+	ssize_t ret;
+	
+	if((meta=fsmount(fsptr,fssize))==NULL){
+		*errnoptr=EFAULT;
+		return -1;
+	}if(fd>=0 && (ret=write(fd,&head,sizeof(head)))!=sizeof(head)){
+		*errnoptr=(ret==-1)?errno:EIO;
+		return -1;
+	}
+	
+	__atomic_store_n(&meta->mnt.trbase,opstart(),__ATOMIC_RELAXED);
+	__atomic_store_n(&meta->mnt.trfd,fd,__ATOMIC_RELEASE);
+	return 0;
+}
@@ -0,0 +1,62 @@
+/*
+
+  The trace format shared by the recorder in implementation.c and the
+  player in fsreplay.c. A trace is a trhead followed by one trrec per
+  call, each followed by its paths. Anything that changes the layout of
+  either, or renumbers an operation, has to bump TRACE_VERSION so that
+  traces written before are refused instead of misread.
+
+*/
+
+#ifndef MYFS_TRACE_H
+#define MYFS_TRACE_H
+
+#include <stdint.h>
+
+#define TRACE_MAGIC ((uint64_t)0x316372545346794dULL)
+#define TRACE_VERSION 3
+#define OP_GETATTR 0
+#define OP_READDIR 1
+#define OP_MKNOD 2
+#define OP_UNLINK 3
+#define OP_RMDIR 4
+#define OP_MKDIR 5
+#define OP_RENAME 6
+#define OP_TRUNCATE 7
+#define OP_OPEN 8
+#define OP_RELEASE 9
+#define OP_READ 10
+#define OP_WRITE 11
+#define OP_WRITEBUF 12
+#define OP_LSEEK 13
+#define OP_UTIMENS 14
+#define OP_STATFS 15
+#define OP_FLUSH 16
+#define OP_CHECKPOINT 17
+#define OPS 18
+#define OP_NAMES {"getattr","readdir","mknod","unlink","rmdir","mkdir","rename","truncate","open","release", \
+	"read","write","writebuf","lseek","utimens","statfs","flush","checkpoint"}
+
+//Starts every trace; reclen is sizeof(trrec) as the recorder had it
+typedef struct {
+	uint64_t magic;
+	uint32_t version;
+	uint32_t reclen;
+} trhead;
+
+//One call in a trace, followed by its path and, for a rename, the new one, each with its terminator. utimens keeps
+//the seconds in off and size and both nanoseconds in fh
+typedef struct {
+	uint32_t len;
+	int32_t err;
+	uint32_t op;
+	uint32_t arg;
+	int64_t ret;
+	uint64_t start;
+	uint64_t ns;
+	uint64_t fh;
+	uint64_t off;
+	uint64_t size;
+} trrec;
+
+#endif